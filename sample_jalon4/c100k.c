@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <time.h>
+
+// Test de charge C100K sur loopback : lance le vrai serveur, lui ouvre
+// autant de connexions inactives que demandé et mesure le débit d'accept
+// et la mémoire retenue par connexion.
+//
+//   ./c100k [serveur [port [connexions]]]
+//
+// Une connexion compte quand le message d'accueil du serveur est reçu : il
+// est envoyé par add_client(), la connexion est donc acceptée et
+// enregistrée. Les adresses sources 127.0.0.x se partagent les connexions
+// par tranches de CONNS_PER_SOURCE : une seule adresse n'aurait pas assez
+// de ports éphémères, et leur recherche au connect() ralentit nettement
+// quand l'adresse en utilise déjà beaucoup.
+
+#define DEFAULT_SERVER "./server"
+#define DEFAULT_PORT 9400
+#define DEFAULT_CONNECTIONS 100000
+#define IN_FLIGHT 512
+#define CONNS_PER_SOURCE 4000
+#define MAX_EVENTS 256
+#define STARTUP_TRIES 100
+#define SETTLE_MS 500
+
+double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// Valeur (en Ko) du champ key d'un fichier de /proc au format "Clé: n kB",
+// -1 si absent
+long proc_kb(const char *path, const char *key) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+    char line[256];
+    size_t key_len = strlen(key);
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            kb = strtol(line + key_len + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+long server_rss_kb(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    return proc_kb(path, "VmRSS");
+}
+
+// Les sockets des deux extrémités sont comptées dans la mémoire noyau
+long kernel_kb(void) {
+    long slab = proc_kb("/proc/meminfo", "Slab");
+    long sock_pages = 0;
+    FILE *f = fopen("/proc/net/sockstat", "r");
+    if (f) {
+        char line[256];
+        while (fgets(line, sizeof(line), f)) {
+            char *mem = strstr(line, " mem ");
+            if (strncmp(line, "TCP:", 4) == 0 && mem)
+                sock_pages = strtol(mem + 5, NULL, 10);
+        }
+        fclose(f);
+    }
+    return slab + sock_pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+// Relève la limite de descripteurs pour tenir wanted sockets ; retourne la
+// limite obtenue
+rlim_t raise_fd_limit(rlim_t wanted) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        perror("getrlimit");
+        return 0;
+    }
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < wanted) {
+        // Seul un processus privilégié peut relever la limite dure
+        struct rlimit raised = { wanted, wanted };
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+            rl = raised;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+        perror("setrlimit");
+    getrlimit(RLIMIT_NOFILE, &rl);
+    return rl.rlim_cur;
+}
+
+pid_t start_server(const char *path, int port) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        // Le serveur trace chaque connexion : sa sortie standard est jetée
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0)
+            dup2(null_fd, STDOUT_FILENO);
+        char port_str[16];
+        snprintf(port_str, sizeof(port_str), "%d", port);
+        execl(path, path, port_str, (char *)NULL);
+        perror("execl");
+        _exit(127);
+    }
+    return pid;
+}
+
+// Ouvre une connexion non bloquante depuis l'adresse source 127.0.0.(1 + source)
+int open_connection(int port, int source) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Le port source est choisi au connect() selon le quadruplet complet
+    int opt = 1;
+    setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &opt, sizeof(opt));
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + source);
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0) {
+        perror("bind");
+        close(fd);
+        return -1;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) {
+        perror("connect");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Attend que le serveur écoute ; retourne 0 s'il répond
+int wait_for_server(pid_t pid, int port) {
+    for (int i = 0; i < STARTUP_TRIES; i++) {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int ok = connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        close(fd);
+        if (ok)
+            return 0;
+        sleep_ms(50);
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_path = argc > 1 ? argv[1] : DEFAULT_SERVER;
+    int port = argc > 2 ? atoi(argv[2]) : DEFAULT_PORT;
+    int target = argc > 3 ? atoi(argv[3]) : DEFAULT_CONNECTIONS;
+    if (port <= 0 || target <= 0) {
+        fprintf(stderr, "Usage: %s [server [port [connections]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    rlim_t limit = raise_fd_limit(target + 64);
+    if (limit < (rlim_t)target + 64) {
+        fprintf(stderr, "File descriptor limit %lu: testing %lu connections instead of %d\n",
+                (unsigned long)limit, (unsigned long)(limit - 64), target);
+        target = limit - 64;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    pid_t pid = start_server(server_path, port);
+    if (wait_for_server(pid, port) < 0) {
+        fprintf(stderr, "Server %s did not start on port %d\n", server_path, port);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return EXIT_FAILURE;
+    }
+    sleep_ms(SETTLE_MS);
+    long rss_before = server_rss_kb(pid);
+    long kernel_before = kernel_kb();
+
+    int epoll_fd = epoll_create1(0);
+    int *fds = malloc(target * sizeof(int));
+    if (epoll_fd < 0 || !fds) {
+        perror("setup");
+        return EXIT_FAILURE;
+    }
+
+    int opened = 0, greeted = 0, failed = 0;
+    double start = now_sec();
+    while (greeted < target && !failed) {
+        // Au plus IN_FLIGHT connexions attendent leur accueil, pour rester
+        // sous la file d'attente d'accept du serveur
+        while (opened < target && opened - greeted < IN_FLIGHT) {
+            int fd = open_connection(port, opened / CONNS_PER_SOURCE);
+            if (fd < 0) {
+                failed = 1;
+                break;
+            }
+            struct epoll_event ev = { .events = EPOLLIN, .data.u32 = opened };
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+            fds[opened++] = fd;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, 5000);
+        if (n == 0) {
+            fprintf(stderr, "No progress for 5 s\n");
+            failed = 1;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = fds[events[i].data.u32];
+            char buf[4096];
+            ssize_t received = recv(fd, buf, sizeof(buf), 0);
+            if (received <= 0) {
+                fprintf(stderr, "Connection %u closed by the server\n", events[i].data.u32);
+                failed = 1;
+                continue;
+            }
+            // Accueil reçu : la connexion reste ouverte, inactive
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            greeted++;
+        }
+    }
+    double elapsed = now_sec() - start;
+
+    sleep_ms(SETTLE_MS);
+    int alive = waitpid(pid, NULL, WNOHANG) == 0;
+    long rss_after = alive ? server_rss_kb(pid) : -1;
+    long kernel_after = kernel_kb();
+
+    printf("Connections: %d/%d held by %s\n", greeted, target, server_path);
+    printf("Accept throughput: %.0f connections/s (%.2f s)\n",
+           elapsed > 0 ? greeted / elapsed : 0.0, elapsed);
+    if (alive && greeted > 0) {
+        printf("Server RSS: %ld kB -> %ld kB, %.0f bytes per connection\n",
+               rss_before, rss_after, (rss_after - rss_before) * 1024.0 / greeted);
+        printf("Kernel memory (both ends): %.0f bytes per connection\n",
+               (kernel_after - kernel_before) * 1024.0 / greeted);
+    }
+    if (!alive)
+        fprintf(stderr, "Server exited during the test\n");
+
+    for (int i = 0; i < opened; i++)
+        close(fds[i]);
+    free(fds);
+    close(epoll_fd);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return alive && greeted == target ? EXIT_SUCCESS : EXIT_FAILURE;
+}
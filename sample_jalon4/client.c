@@ -1,588 +1,2110 @@
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
-#include <poll.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <time.h>  // Pour ctime()
-#include "msg_struct.h"
-#include "common.h"
-
-#define BUFFER_SIZE 1024
-#define FILE_CHUNK_SIZE 8192
-#define INBOX_DIR ".re216/inbox"
-
-// Variables globales
-static int sockfd;
-static char current_nickname[NICK_LEN] = {0};
-
-// Structure pour le transfert de fichiers
-typedef struct {
-    char filename[256];
-    char sender[NICK_LEN];
-    int listening_socket;
-    char *file_path;
-} FileTransfer;
-
-static FileTransfer current_transfer = {0};
-
-// Déclarations des fonctions (prototypes)
-int handle_connect(const char *server_name, const char *server_port);
-void handle_file_accept(const char *receiver, const char *address_port);
-void send_message_to_server(int sockfd, enum msg_type type, const char *nick_sender, 
-                          const char *infos, const char *payload);
-void handle_file_request(const char *sender, const char *filename);
-void send_file(const char *recipient, const char *filepath);
-void receive_file(int sock);
-int test_file(const char *filepath);
-void handle_server_message(int sockfd);
-void echo_client(int sockfd);
-void ensure_inbox_directory(void);
-
-// Implémentation des fonctions
-
-// vérifie si le répertoire de réception des fichiers (INBOX_DIR) existe
-void ensure_inbox_directory(void) {
-    struct stat st = {0};
-    if (stat(INBOX_DIR, &st) == -1) {
-        char command[512];
-        snprintf(command, sizeof(command), "mkdir -p %s", INBOX_DIR);
-        system(command);
-    }
-}
-
-//Établit une connexion avec le serveur.
-int handle_connect(const char *server_name, const char *server_port) {
-    struct addrinfo hints, *result, *rp;
-    int sfd;
-
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-
-    int status = getaddrinfo(server_name, server_port, &hints, &result);
-    if (status != 0) {
-        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
-        exit(EXIT_FAILURE);
-    }
-
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-        sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-        if (sfd == -1) {
-            continue;
-        }
-        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
-            break;
-        }
-        close(sfd);
-    }
-
-    freeaddrinfo(result);
-
-    if (rp == NULL) {
-        fprintf(stderr, "Could not connect\n");
-        exit(EXIT_FAILURE);
-    }
-
-    return sfd;
-}
-
-//Vérifie l'existence d'un fichier, ses permissions et ses informations 
-int test_file(const char *filepath) {
-    struct stat st;
-    
-    if (stat(filepath, &st) == -1) {
-        printf("Erreur stat: %s\n", strerror(errno));
-        return -1;
-    }
-
-    printf("Informations fichier:\n");
-    printf("- Taille: %ld bytes\n", st.st_size);
-    printf("- Permissions: %o\n", st.st_mode & 0777);
-    printf("- Dernier accès: %s", ctime(&st.st_atime));
-    printf("- Dernière modification: %s", ctime(&st.st_mtime));
-
-    return 0;
-}
-
-// Envoie un message structuré au serveur
-void send_message_to_server(int sockfd, enum msg_type type, const char *nick_sender, 
-                          const char *infos, const char *payload) {
-    struct message msg;
-    memset(&msg, 0, sizeof(struct message));
-    
-    msg.type = type;
-    if (nick_sender) {
-        strncpy(msg.nick_sender, nick_sender, NICK_LEN - 1);
-    }
-    if (infos) {
-        strncpy(msg.infos, infos, INFOS_LEN - 1);
-    }
-    msg.pld_len = payload ? strlen(payload) : 0;
-
-    if (send(sockfd, &msg, sizeof(msg), 0) < 0) {
-        perror("Erreur d'envoi de la structure message");
-        return;
-    }
-
-    if (payload && msg.pld_len > 0) {
-        if (send(sockfd, payload, msg.pld_len, 0) < 0) {
-            perror("Erreur d'envoi du payload");
-            return;
-        }
-    }
-}
-
-//Gère une demande de transfert de fichier. Demande à l'utilisateur s'il accepte la réception du fichier
-void handle_file_request(const char *sender, const char *filename) {
-    printf("%s wants you to accept the transfer of the file named \"%s\". Do you accept? [Y/N]\n", 
-           sender, filename);
-    
-    char response;
-    while ((response = getchar()) != 'Y' && response != 'N') {
-        if (response != '\n') {
-            printf("Please enter Y or N: ");
-        }
-    }
-    
-    if (response == 'Y') {
-        char address_str[50] = {0};
-        int listening_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (listening_socket < 0) {
-            perror("Socket creation failed");
-            return;
-        }
-
-        struct sockaddr_in server_addr;
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_addr.s_addr = INADDR_ANY;
-        server_addr.sin_port = 0;  // Port automatique
-
-        if (bind(listening_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-            perror("Bind failed");
-            close(listening_socket);
-            return;
-        }
-
-        if (listen(listening_socket, 1) < 0) {
-            perror("Listen failed");
-            close(listening_socket);
-            return;
-        }
-
-        socklen_t len = sizeof(server_addr);
-        if (getsockname(listening_socket, (struct sockaddr*)&server_addr, &len) < 0) {
-            perror("getsockname failed");
-            close(listening_socket);
-            return;
-        }
-
-        snprintf(address_str, sizeof(address_str), "127.0.0.1:%d", ntohs(server_addr.sin_port));
-        
-        strncpy(current_transfer.filename, filename, sizeof(current_transfer.filename) - 1);
-        strncpy(current_transfer.sender, sender, sizeof(current_transfer.sender) - 1);
-        current_transfer.listening_socket = listening_socket;
-        
-        ensure_inbox_directory();
-        char file_path[512];
-        snprintf(file_path, sizeof(file_path), "%s/%s", INBOX_DIR, filename);
-        current_transfer.file_path = strdup(file_path);
-
-        send_message_to_server(sockfd, FILE_ACCEPT, current_nickname, sender, address_str);
-    } else {
-        send_message_to_server(sockfd, FILE_REJECT, current_nickname, sender, NULL);
-    }
-    
-    while (getchar() != '\n');  // Vider le buffer
-}
-
-//Prépare un fichier pour l'envoi à un destinataire. Vérifie son existence et sa lisibilité, puis ouvre le fichier pour envoyer une demande de transfert au serveur.
-void send_file(const char *recipient, const char *filepath) {
-    printf("Tentative d'envoi du fichier:\n");
-    printf("- Chemin: %s\n", filepath);
-
-    if (access(filepath, F_OK) == -1) {
-        printf("Le fichier n'existe pas: %s\n", strerror(errno));
-        return;
-    }
-
-    if (access(filepath, R_OK) == -1) {
-        printf("Pas de permission de lecture: %s\n", strerror(errno));
-        return;
-    }
-
-    FILE *file = fopen(filepath, "rb");
-    if (!file) {
-        printf("Erreur ouverture fichier: %s\n", strerror(errno));
-        return;
-    }
-
-    fseek(file, 0, SEEK_END);
-    long filesize = ftell(file);
-    rewind(file);
-
-    printf("- Taille: %ld bytes\n", filesize);
-
-    const char *filename = strrchr(filepath, '/');
-    filename = filename ? filename + 1 : filepath;
-
-    printf("- Nom du fichier: %s\n", filename);
-
-    char test_buf[16] = {0};
-    size_t read = fread(test_buf, 1, sizeof(test_buf) - 1, file);
-    printf("- Premier contenu (%zu bytes): %s\n", read, test_buf);
-    rewind(file);
-
-    strncpy(current_transfer.filename, filename, sizeof(current_transfer.filename) - 1);
-    current_transfer.file_path = strdup(filepath);
-
-    send_message_to_server(sockfd, FILE_REQUEST, current_nickname, recipient, filename);
-    printf("Demande de transfert envoyée\n");
-
-    fclose(file);
-}
-
-
-//Reçoit un fichier via un socket donné. Ouvre le fichier pour l'écriture et sauvegarde les données reçues
-void receive_file(int sock) {
-    struct message msg;
-    if (recv(sock, &msg, sizeof(msg), 0) <= 0) {
-        perror("Failed to receive message header");
-        return;
-    }
-
-    if (msg.type != FILE_SEND) {
-        printf("Unexpected message type received\n");
-        return;
-    }
-
-    FILE *file = fopen(current_transfer.file_path, "wb");
-    if (!file) {
-        printf("Cannot open file for writing\n");
-        return;
-    }
-
-    printf("Receiving file from %s...\n", msg.nick_sender);
-
-    char buffer[FILE_CHUNK_SIZE];
-    size_t total_received = 0;
-    ssize_t bytes_received;
-
-    while (total_received < msg.pld_len && 
-           (bytes_received = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
-        size_t written = fwrite(buffer, 1, bytes_received, file);
-        if (written != bytes_received) {
-            printf("Error writing to file\n");
-            break;
-        }
-        total_received += bytes_received;
-    }
-
-    fclose(file);
-    printf("File saved as %s\n", current_transfer.file_path);
-
-    send_message_to_server(sockfd, FILE_ACK, current_nickname, 
-                          msg.nick_sender, current_transfer.filename);
-
-    free(current_transfer.file_path);
-    memset(&current_transfer, 0, sizeof(current_transfer));
-}
-// Gère les messages du serveur. Reçoit un message structuré, vérifie le type, et exécute différentes actions en fonction du type
-void handle_server_message(int sockfd) {
-    struct message msg;
-    memset(&msg, 0, sizeof(msg));
-
-    ssize_t received = recv(sockfd, &msg, sizeof(struct message), 0);
-    if (received <= 0) {
-        printf("Serveur déconnecté\n");
-        exit(EXIT_FAILURE);
-    }
-
-    char payload[BUFFER_SIZE] = {0};
-    if (msg.pld_len > 0) {
-        received = recv(sockfd, payload, msg.pld_len, 0);
-        if (received <= 0) {
-            printf("Erreur de réception du payload\n");
-            return;
-        }
-        payload[received] = '\0';
-    }
-
-    switch (msg.type) {
-        case NICKNAME_NEW:
-        case NICKNAME_LIST:
-        case NICKNAME_INFOS:
-        case ECHO_SEND:
-            printf("%s\n", payload);
-            break;
-        case UNICAST_SEND:
-            printf("[%s]: %s\n", msg.nick_sender, payload);
-            break;
-        case BROADCAST_SEND:
-            printf("[%s][All]: %s\n", msg.nick_sender, payload);
-            break;
-        case MULTICAST_CREATE:
-            printf("[Server] %s\n", payload);
-            break;
-        case MULTICAST_LIST:
-            printf("%s", payload);
-            break;
-        case MULTICAST_JOIN:
-            printf("[%s] %s\n", msg.infos, payload);
-            break;
-        case MULTICAST_QUIT:
-            printf("[%s] %s\n", msg.infos, payload);
-            break;
-        case MULTICAST_SEND:
-            printf("[%s][%s] %s\n", msg.infos, msg.nick_sender, payload);
-            break;
-        case FILE_REQUEST:
-            handle_file_request(msg.nick_sender, payload);
-            break;
-        case FILE_ACCEPT:
-            printf("[Server] %s accepted file transfer\n", msg.infos);
-            handle_file_accept(msg.infos, payload);
-            break;
-        case FILE_REJECT:
-            printf("[Server] %s rejected file transfer\n", msg.infos);
-            if (current_transfer.file_path) {
-                free(current_transfer.file_path);
-                memset(&current_transfer, 0, sizeof(current_transfer));
-            }
-            break;
-        case FILE_ACK:
-            printf("[Server] %s has received the file %s\n", msg.nick_sender, msg.infos);
-            break;
-        default:
-            printf("Message de type inconnu reçu\n");
-            break;
-    }
-}
-//Interprète les commandes de l'utilisateur (ex. changement de pseudo, envoi de messages) et gère les transferts de fichiers entrants.
-void echo_client(int sockfd) {
-    char buff[BUFFER_SIZE];
-    struct pollfd fds[3];  // Pour STDIN, socket serveur, et socket de fichier
-
-    fds[0].fd = STDIN_FILENO;
-    fds[0].events = POLLIN;
-    fds[1].fd = sockfd;
-    fds[1].events = POLLIN;
-
-    printf("Connecté au serveur. Tapez /help pour la liste des commandes.\n");
-    ensure_inbox_directory();
-
-    while (1) {
-        int nfds = 2;  // Par défaut, on surveille STDIN et le socket serveur
-        if (current_transfer.listening_socket > 0) {
-            fds[2].fd = current_transfer.listening_socket;
-            fds[2].events = POLLIN;
-            nfds = 3;
-        }
-
-        int ret = poll(fds, nfds, -1);
-        if (ret < 0) {
-            perror("poll()");
-            break;
-        }
-
-        if (fds[0].revents & POLLIN) {
-            memset(buff, 0, BUFFER_SIZE);
-            if (fgets(buff, BUFFER_SIZE, stdin) == NULL) {
-                break;
-            }
-            buff[strcspn(buff, "\n")] = 0;
-
-            if (strlen(buff) == 0) {
-                continue;
-            }
-
-            if (strcmp(buff, "/quit") == 0) {
-                printf("Déconnexion...\n");
-                break;
-            } else if (strncmp(buff, "/nick ", 6) == 0) {
-                strncpy(current_nickname, buff + 6, NICK_LEN - 1);
-                send_message_to_server(sockfd, NICKNAME_NEW, "", buff + 6, NULL);
-            } else if (strcmp(buff, "/who") == 0) {
-                send_message_to_server(sockfd, NICKNAME_LIST, "", NULL, NULL);
-            } else if (strncmp(buff, "/whois ", 7) == 0) {
-                send_message_to_server(sockfd, NICKNAME_INFOS, "", buff + 7, NULL);
-            } else if (strncmp(buff, "/msgall ", 8) == 0) {
-                send_message_to_server(sockfd, BROADCAST_SEND, "", NULL, buff + 8);
-            } else if (strncmp(buff, "/msg ", 5) == 0) {
-                char *recipient = strtok(buff + 5, " ");
-                char *message = strtok(NULL, "");
-                if (recipient && message) {
-                    send_message_to_server(sockfd, UNICAST_SEND, "", recipient, message + 1);
-                } else {
-                    printf("Usage: /msg <pseudo> <message>\n");
-                }
-            } else if (strncmp(buff, "/create ", 8) == 0) {
-                send_message_to_server(sockfd, MULTICAST_CREATE, "", buff + 8, NULL);
-            } else if (strcmp(buff, "/channel_list") == 0) {
-                send_message_to_server(sockfd, MULTICAST_LIST, "", NULL, NULL);
-            } else if (strncmp(buff, "/join ", 6) == 0) {
-                send_message_to_server(sockfd, MULTICAST_JOIN, "", buff + 6, NULL);
-            } else if (strncmp(buff, "/quit ", 6) == 0) {
-                send_message_to_server(sockfd, MULTICAST_QUIT, "", buff + 6, NULL);
-            } else if (strncmp(buff, "/send ", 6) == 0) {
-                char *recipient = strtok(buff + 6, " ");
-                char *filepath = strtok(NULL, "");
-                if (recipient && filepath) {
-                    // Supprimer les espaces au début du filepath
-                    while (*filepath == ' ') filepath++;
-                    // Supprimer les guillemets si présents
-                    if (filepath[0] == '"') {
-                        filepath++;
-                        size_t len = strlen(filepath);
-                        if (len > 0 && filepath[len-1] == '"') {
-                            filepath[len-1] = '\0';
-                        }
-                    }
-                    if (test_file(filepath) == 0) {
-                        send_file(recipient, filepath);
-                    }
-                } else {
-                    printf("Usage: /send <username> <filepath>\n");
-                }
-            } else if (strcmp(buff, "/help") == 0) {
-                printf("Commandes disponibles:\n");
-                printf("/nick <pseudo> : définir son pseudo\n");
-                printf("/who : liste des utilisateurs connectés\n");
-                printf("/whois <pseudo> : informations sur un utilisateur\n");
-                printf("/msgall <message> : envoyer un message à tous\n");
-                printf("/msg <pseudo> <message> : envoyer un message privé\n");
-                printf("/create <channel> : créer un salon\n");
-                printf("/channel_list : liste des salons\n");
-                printf("/join <channel> : rejoindre un salon\n");
-                printf("/quit <channel> : quitter un salon\n");
-                printf("/send <pseudo> <filepath> : envoyer un fichier\n");
-                printf("/quit : quitter le chat\n");
-            } else {
-                // Message pour le salon actuel
-                send_message_to_server(sockfd, MULTICAST_SEND, "", NULL, buff);
-            }
-        }
-
-        if (fds[1].revents & POLLIN) {
-            handle_server_message(sockfd);
-        }
-
-        // Gérer les connexions entrantes pour le transfert de fichiers
-        if (nfds > 2 && (fds[2].revents & POLLIN)) {
-            struct sockaddr_in client_addr;
-            socklen_t client_len = sizeof(client_addr);
-            int client_sock = accept(current_transfer.listening_socket, 
-                                   (struct sockaddr*)&client_addr, &client_len);
-            if (client_sock < 0) {
-                perror("accept");
-                continue;
-            }
-
-            close(current_transfer.listening_socket);
-            current_transfer.listening_socket = -1;
-
-            receive_file(client_sock);
-            close(client_sock);
-        }
-    }
-}
-//Gère la connexion au destinataire pour le transfert de fichiers une fois que l'autre côté a accepté
-void handle_file_accept(const char *receiver, const char *address_port) {
-    char ip[16];
-    int port;
-    if (sscanf(address_port, "%[^:]:%d", ip, &port) != 2) {
-        printf("Invalid address format received\n");
-        return;
-    }
-
-    // Se connecter au récepteur
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    if (inet_pton(AF_INET, ip, &addr.sin_addr) <= 0) {
-        printf("Invalid IP address\n");
-        return;
-    }
-
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock < 0) {
-        perror("Socket creation failed");
-        return;
-    }
-
-    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        perror("Connection failed");
-        close(sock);
-        return;
-    }
-
-    printf("Connected to receiver. Sending file...\n");
-
-    // Envoyer le fichier
-    FILE *file = fopen(current_transfer.file_path, "rb");
-    if (!file) {
-        printf("Cannot open file for sending\n");
-        close(sock);
-        return;
-    }
-
-    // Envoyer d'abord la structure message
-    struct message msg;
-    memset(&msg, 0, sizeof(msg));
-    msg.type = FILE_SEND;
-    strncpy(msg.nick_sender, current_nickname, NICK_LEN - 1);
-    strncpy(msg.infos, current_transfer.filename, INFOS_LEN - 1);
-
-    fseek(file, 0, SEEK_END);
-    msg.pld_len = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    if (send(sock, &msg, sizeof(msg), 0) < 0) {
-        perror("Failed to send message header");
-        fclose(file);
-        close(sock);
-        return;
-    }
-
-    char buffer[FILE_CHUNK_SIZE];
-    size_t bytes_read;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
-        if (send(sock, buffer, bytes_read, 0) < 0) {
-            perror("Failed to send file chunk");
-            break;
-        }
-    }
-
-    fclose(file);
-    close(sock);
-    printf("File sent successfully\n");
-    free(current_transfer.file_path);
-    memset(&current_transfer, 0, sizeof(current_transfer));
-}
-
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_name> <server_port>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    sockfd = handle_connect(argv[1], argv[2]);
-    printf("Connecté au serveur %s:%s\n", argv[1], argv[2]);
-
-    echo_client(sockfd);
-
-    if (current_transfer.listening_socket > 0) {
-        close(current_transfer.listening_socket);
-    }
-    if (current_transfer.file_path) {
-        free(current_transfer.file_path);
-    }
-    close(sockfd);
-    return EXIT_SUCCESS;
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>  // Pour ctime()
+#include <signal.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include "msg_struct.h"
+#include "common.h"
+
+#define BUFFER_SIZE 1024
+#define FILE_CHUNK_SIZE 8192
+#define SENDFILE_MAX (1 << 30)     // borne d'un appel à sendfile()
+#define CRC_CHUNK_SIZE (256 << 10)  // octets passés au CRC pendant qu'ils sont en cache
+#define CRC_STEP_SIZE (4 << 20)     // octets d'un début de fichier hachés entre deux poll()
+#define RECV_BUFFER_SIZE (1 << 20)  // tampon et tube de réception d'un fichier
+#define RECV_BUFFER_ALIGN 4096
+#define DEFAULT_STREAMS 4
+#define DEFAULT_OFFER_TIMEOUT 120   // secondes laissées pour répondre à une offre de fichier
+#define MIN_STREAM_BYTES (4 * 1024 * 1024)  // plage minimale d'un flux
+#define INBOX_PARENT ".re216"
+#define PART_SUFFIX ".part"
+#define INBOX_DIR ".re216/inbox"
+
+// Variables globales
+static int sockfd;
+static char current_nickname[NICK_LEN] = {0};
+static int proto_in = PROTO_LEGACY;     // version des trames reçues du serveur
+static int proto_out = PROTO_LEGACY;    // version des trames envoyées au serveur
+static struct nick_dict nick_dict;      // pseudos internalisés par le serveur (v2)
+static int relay_mode = 0;              // fichiers reçus par le relais du serveur (-r)
+static int max_streams = DEFAULT_STREAMS;   // connexions de données par fichier (-s)
+static int offer_timeout = DEFAULT_OFFER_TIMEOUT;   // délai de réponse aux offres (-t)
+
+// Flux reçu du serveur pas encore découpé en trames (au plus une trame)
+static char inbuf[sizeof(struct message) + BUFFER_SIZE];
+static size_t inlen = 0;
+
+// Plage d'un fichier transportée par une connexion de données
+typedef struct {
+    int sock;
+    off_t start;    // début de la plage
+    off_t offset;   // position dans le fichier des prochains octets
+    size_t left;    // octets de la plage encore attendus
+    int verify;     // plage suivie de son CRC32C
+    int verified;   // réception : CRC32C de la plage reçu et conforme
+    uint32_t crc;   // CRC32C des octets de la plage déjà passés
+    off_t crc_to;   // fin des octets comptés dans crc (envoi : en avance sur offset)
+    const char *map;    // réception : fichier projeté pour le CRC, ou NULL
+    struct message hdr;     // en-tête FILE_SEND, reçu par morceaux
+    size_t hdr_len;
+    unsigned char trailer[CHECKSUM_LEN];    // CRC32C de la plage, reçu ou envoyé
+    size_t trailer_len;
+    int connecting;         // connexion pas encore établie
+    char out[RELAY_HELLO_LEN + sizeof(struct message)];     // octets à envoyer
+    size_t out_len, out_done;
+} FileStream;
+
+enum transfer_dir { TRANSFER_UPLOAD, TRANSFER_DOWNLOAD };
+
+// Transfert de fichier en cours, repéré par son numéro. Un envoi attend la
+// réponse du destinataire, une réception ses connexions de données ; tous
+// avancent ensuite au rythme de poll() dans echo_client, sans jamais
+// bloquer.
+typedef struct FileTransfer {
+    unsigned int id;
+    enum transfer_dir dir;
+    char filename[256];
+    char peer[NICK_LEN];        // correspondant
+    unsigned int peer_id;       // numéro du transfert chez l'émetteur, 0 s'il n'en donne pas
+    int offered;                // offre reçue, en attente de /accept ou /reject
+    long long expires_ms;       // refus automatique de l'offre (monotonic_ms())
+    char *file_path;
+    off_t resume_offset;        // début du fichier proposé en reprise, 0 sinon
+    int listening_socket;       // -1 si aucun
+    int relayed;
+
+    // Données, une fois le transfert accepté
+    FileStream streams[MAX_STREAMS];
+    int opened;                 // connexions de données ouvertes
+    int headers;                // en-têtes reçus
+    int count;                  // flux du transfert, 0 avant le premier en-tête reçu
+    int ready;                  // fichier prêt, les données peuvent passer
+    size_t total;               // taille du fichier
+    size_t expected;            // octets à transférer (tout sauf le début repris)
+    size_t transferred;
+    off_t base;                 // début du fichier repris
+    int fd;
+    const char *map;
+    int pipefd[2];
+    int zero_copy;              // splice() en réception, sendfile() en envoi
+    struct timespec start;
+
+    // Reprise : CRC32C d'un début de fichier, calculé par étapes entre deux
+    // poll() ; en réception celui du fichier temporaire, avant de répondre
+    // à l'offre, en envoi celui du fichier, avant de choisir l'offset de
+    // départ
+    int hashing;                // calcul en cours
+    int part_fd;                // fichier temporaire lu pour le calcul, -1 sinon
+    off_t hash_len;             // octets à couvrir
+    off_t hash_done;
+    uint32_t hash_crc;
+    char reply[128];            // FILE_ACCEPT à envoyer, ou adresse reçue en réponse
+    struct FileTransfer *next;
+} FileTransfer;
+
+static FileTransfer *transfers = NULL;  // par ordre de création
+static unsigned int next_transfer_id = 1;
+
+// Socket surveillée par poll() pour un transfert
+typedef struct {
+    unsigned int id;    // transfert concerné
+    int stream;         // connexion de données, ou -1 pour le socket d'écoute
+} PollSlot;
+
+// Message reçu en plusieurs morceaux, en cours de réassemblage ; un
+// émetteur n'a qu'un message en cours à la fois
+typedef struct PartialMessage {
+    char nick[NICK_LEN];
+    char *data;
+    size_t len;
+    struct PartialMessage *next;
+} PartialMessage;
+
+static PartialMessage *partial_messages = NULL;
+
+// Déclarations des fonctions (prototypes)
+int handle_connect(const char *server_name, const char *server_port);
+void handle_file_accept(FileTransfer *transfer, const char *address_port);
+void start_upload(FileTransfer *transfer);
+void send_file_accept(FileTransfer *transfer);
+void send_message_to_server(int sockfd, enum msg_type type, const char *nick_sender, 
+                          const char *infos, const char *payload, size_t len);
+void handle_file_request(const char *sender, const char *filename, unsigned int peer_id);
+void send_file(const char *recipient, const char *filepath);
+void handle_relay_ready(FileTransfer *transfer, const char *address);
+void handle_transfer_event(FileTransfer *transfer, int stream);
+int send_stream_data(FileTransfer *transfer, FileStream *stream);
+void finish_upload(FileTransfer *transfer, int ret);
+int test_file(const char *filepath);
+void handle_server_message(int sockfd);
+void dispatch_server_message(struct message *msg, const char *payload, size_t len);
+void echo_client(int sockfd);
+void ensure_inbox_directory(void);
+
+// Implémentation des fonctions
+
+// CRC32C (polynôme de Castagnoli). crc32c_update() prolonge le CRC des
+// octets déjà vus : on part de 0 et on enchaîne les morceaux dans l'ordre.
+// Les fonctions crc32c_raw_* travaillent sur l'état interne (le CRC
+// complémenté), qui est linéaire : raw(s, A||B) = shift_B(raw(s, A)) ^
+// raw(0, B).
+uint32_t crc32c_raw_sw(uint32_t s, const unsigned char *p, size_t len) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+            table[i] = c;
+        }
+    }
+    while (len--)
+        s = table[(s ^ *p++) & 0xff] ^ (s >> 8);
+    return s;
+}
+
+// x^e mod P, dans la représentation réfléchie du CRC (le bit 31 porte x^0)
+static uint32_t crc32c_xpow(unsigned int e) {
+    uint32_t r = 0x80000000;
+    while (e--)
+        r = (r >> 1) ^ (r & 1 ? 0x82F63B78 : 0);
+    return r;
+}
+
+#if defined(__x86_64__)
+// Avec SSE4.2, l'instruction crc32 traite 8 octets à la fois mais sa
+// latence limite une chaîne à 8 octets tous les 3 cycles. On calcule donc
+// trois chaînes indépendantes sur trois voies consécutives de CRC32C_LANE
+// octets, puis on les recombine : décaler l'état d'une voie de CRC32C_LANE
+// octets nuls est une application linéaire, tabulée octet par octet.
+#define CRC32C_LANE 4096
+
+static uint32_t crc32c_shift_table[4][256];
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_raw_lane(uint32_t s, const unsigned char *p, size_t len) {
+    uint64_t s64 = s;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        s64 = _mm_crc32_u64(s64, word);
+    }
+    s = s64;
+    while (len--)
+        s = _mm_crc32_u8(s, *p++);
+    return s;
+}
+
+static uint32_t crc32c_shift(uint32_t s) {
+    return crc32c_shift_table[0][s & 0xff] ^ crc32c_shift_table[1][(s >> 8) & 0xff] ^
+           crc32c_shift_table[2][(s >> 16) & 0xff] ^ crc32c_shift_table[3][s >> 24];
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32c_raw_hw(uint32_t s, const unsigned char *p, size_t len) {
+    if (!crc32c_shift_table[0][1]) {
+        static const unsigned char zeros[CRC32C_LANE];
+        for (int k = 0; k < 4; k++) {
+            for (uint32_t b = 0; b < 256; b++)
+                crc32c_shift_table[k][b] = crc32c_raw_lane(b << (8 * k), zeros, CRC32C_LANE);
+        }
+    }
+
+    for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE, len -= 3 * CRC32C_LANE) {
+        uint64_t s0 = s, s1 = 0, s2 = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t w0, w1, w2;
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + CRC32C_LANE + i, 8);
+            memcpy(&w2, p + 2 * CRC32C_LANE + i, 8);
+            s0 = _mm_crc32_u64(s0, w0);
+            s1 = _mm_crc32_u64(s1, w1);
+            s2 = _mm_crc32_u64(s2, w2);
+        }
+        s = crc32c_shift(crc32c_shift((uint32_t)s0) ^ (uint32_t)s1) ^ (uint32_t)s2;
+    }
+    return crc32c_raw_lane(s, p, len);
+}
+
+// Avec VPCLMULQDQ (AVX-512), on replie plutôt les données par
+// multiplications sans retenue : chaque bloc de 128 bits A, vu comme un
+// polynôme, est remplacé par A·x^d mod P, qui s'ajoute au bloc situé d
+// bits plus loin. Quatre registres de 512 bits avancent de 256 octets par
+// tour, puis sont repliés en un seul bloc de 128 bits dont l'instruction
+// crc32 donne l'état final. Les constantes de repli se déduisent de x^e
+// mod P, calculé une fois pour toutes.
+#define CRC32C_FOLD_MIN 256
+
+static __m128i crc32c_fold_k256, crc32c_fold_k64, crc32c_fold_k48, crc32c_fold_k32,
+               crc32c_fold_k16;
+
+// Constantes pour replier un bloc de 128 bits sur celui situé d bits plus
+// loin : la moitié basse du bloc (la plus ancienne) est multipliée par
+// x^(d+64), la moitié haute par x^d ; la multiplication de valeurs
+// réfléchies ajoute un facteur x, d'où les exposants diminués de un.
+static __m128i crc32c_fold_constants(unsigned int d) {
+    return _mm_set_epi64x((uint64_t)crc32c_xpow(d - 1) << 32,
+                          (uint64_t)crc32c_xpow(d + 63) << 32);
+}
+
+__attribute__((target("pclmul")))
+static inline __m128i crc32c_fold128(__m128i x, __m128i k, __m128i next) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                                       _mm_clmulepi64_si128(x, k, 0x11)), next);
+}
+
+__attribute__((target("avx512f,vpclmulqdq")))
+static inline __m512i crc32c_fold512(__m512i x, __m512i k, __m512i next) {
+    return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+                                     _mm512_clmulepi64_epi128(x, k, 0x11), next, 0x96);
+}
+
+__attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+uint32_t crc32c_raw_clmul(uint32_t s, const unsigned char *p, size_t len) {
+    if (len < CRC32C_FOLD_MIN)
+        return crc32c_raw_lane(s, p, len);
+    if (!_mm_extract_epi64(crc32c_fold_k16, 1)) {
+        crc32c_fold_k256 = crc32c_fold_constants(2048);
+        crc32c_fold_k64 = crc32c_fold_constants(512);
+        crc32c_fold_k48 = crc32c_fold_constants(384);
+        crc32c_fold_k32 = crc32c_fold_constants(256);
+        crc32c_fold_k16 = crc32c_fold_constants(128);
+    }
+
+    // L'état courant s'ajoute aux 32 premiers bits des données
+    __m512i k256 = _mm512_broadcast_i32x4(crc32c_fold_k256);
+    __m512i x0 = _mm512_xor_si512(_mm512_loadu_si512(p),
+                                  _mm512_castsi128_si512(_mm_cvtsi32_si128(s)));
+    __m512i x1 = _mm512_loadu_si512(p + 64);
+    __m512i x2 = _mm512_loadu_si512(p + 128);
+    __m512i x3 = _mm512_loadu_si512(p + 192);
+    for (p += 256, len -= 256; len >= 256; p += 256, len -= 256) {
+        x0 = crc32c_fold512(x0, k256, _mm512_loadu_si512(p));
+        x1 = crc32c_fold512(x1, k256, _mm512_loadu_si512(p + 64));
+        x2 = crc32c_fold512(x2, k256, _mm512_loadu_si512(p + 128));
+        x3 = crc32c_fold512(x3, k256, _mm512_loadu_si512(p + 192));
+    }
+
+    __m512i k64 = _mm512_broadcast_i32x4(crc32c_fold_k64);
+    x3 = crc32c_fold512(crc32c_fold512(crc32c_fold512(x0, k64, x1), k64, x2), k64, x3);
+    for (; len >= 64; p += 64, len -= 64)
+        x3 = crc32c_fold512(x3, k64, _mm512_loadu_si512(p));
+
+    __m128i x = _mm512_extracti32x4_epi32(x3, 3);
+    x = crc32c_fold128(_mm512_extracti32x4_epi32(x3, 0), crc32c_fold_k48, x);
+    x = crc32c_fold128(_mm512_extracti32x4_epi32(x3, 1), crc32c_fold_k32, x);
+    x = crc32c_fold128(_mm512_extracti32x4_epi32(x3, 2), crc32c_fold_k16, x);
+    s = _mm_crc32_u64(_mm_crc32_u64(0, _mm_cvtsi128_si64(x)), _mm_extract_epi64(x, 1));
+    return crc32c_raw_lane(s, p, len);
+}
+#endif
+
+uint32_t crc32c_update(uint32_t crc, const void *data, size_t len) {
+    static uint32_t (*raw)(uint32_t, const unsigned char *, size_t);
+    if (!raw) {
+        raw = crc32c_raw_sw;
+#if defined(__x86_64__)
+        if (__builtin_cpu_supports("sse4.2"))
+            raw = crc32c_raw_hw;
+        if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul") &&
+            __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq"))
+            raw = crc32c_raw_clmul;
+#endif
+    }
+    return ~raw(~crc, data, len);
+}
+
+// Prolonge *crc des len octets de fd à partir de offset ; sert aux octets
+// que sendfile() ou splice() copient sans les faire passer par nous. Ils
+// sont lus dans le cache de pages, directement par la projection map du
+// fichier si on en a une, sinon par pread(). Retourne -1 si on ne peut pas
+// les lire en entier.
+int crc_file_range(int fd, const char *map, off_t offset, size_t len, uint32_t *crc) {
+    if (map) {
+        *crc = crc32c_update(*crc, map + offset, len);
+        return 0;
+    }
+
+    static char *buf;
+    if (!buf && posix_memalign((void **)&buf, RECV_BUFFER_ALIGN, RECV_BUFFER_SIZE) != 0) {
+        buf = NULL;
+        return -1;
+    }
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len < RECV_BUFFER_SIZE ? len : RECV_BUFFER_SIZE, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        *crc = crc32c_update(*crc, buf, n);
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Projette les size premiers octets de fd en lecture pour en calculer le
+// CRC ; retourne NULL si c'est impossible (on passera par pread())
+const char *map_for_crc(int fd, off_t size) {
+    if (size <= 0 || (uint64_t)size > SIZE_MAX)
+        return NULL;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+    madvise(map, size, MADV_SEQUENTIAL);
+    return map;
+}
+
+// Crée si besoin le répertoire de réception des fichiers (INBOX_DIR)
+void ensure_inbox_directory(void) {
+    const char *dirs[] = { INBOX_PARENT, INBOX_DIR };
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+        if (mkdir(dirs[i], 0755) < 0 && errno != EEXIST) {
+            printf("Cannot create %s: %s\n", dirs[i], strerror(errno));
+            return;
+        }
+    }
+}
+
+//Établit une connexion avec le serveur.
+int handle_connect(const char *server_name, const char *server_port) {
+    struct addrinfo hints, *result, *rp;
+    int sfd;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    int status = getaddrinfo(server_name, server_port, &hints, &result);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        exit(EXIT_FAILURE);
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+        sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (sfd == -1) {
+            continue;
+        }
+        if (connect(sfd, rp->ai_addr, rp->ai_addrlen) != -1) {
+            break;
+        }
+        close(sfd);
+    }
+
+    freeaddrinfo(result);
+
+    if (rp == NULL) {
+        fprintf(stderr, "Could not connect\n");
+        exit(EXIT_FAILURE);
+    }
+
+    return sfd;
+}
+
+//Vérifie l'existence d'un fichier, ses permissions et ses informations 
+int test_file(const char *filepath) {
+    struct stat st;
+    
+    if (stat(filepath, &st) == -1) {
+        printf("Erreur stat: %s\n", strerror(errno));
+        return -1;
+    }
+
+    printf("Informations fichier:\n");
+    printf("- Taille: %ld bytes\n", st.st_size);
+    printf("- Permissions: %o\n", st.st_mode & 0777);
+    printf("- Dernier accès: %s", ctime(&st.st_atime));
+    printf("- Dernière modification: %s", ctime(&st.st_mtime));
+
+    return 0;
+}
+
+// Envoie tout un vecteur d'octets, en reprenant après un envoi partiel
+int send_all_iov(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+
+    while (iovcnt > 0) {
+        mh.msg_iov = iov;
+        mh.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &mh, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Envoie une trame au serveur (en-tête et payload en un seul appel)
+void send_frame_to_server(int sockfd, enum msg_type type, const char *nick_sender,
+                          const char *infos, const char *payload, size_t pld_len) {
+    if (proto_out == PROTO_V2) {
+        char hdr[V2_HEADER_MAX];
+        struct iovec iov[2] = {
+            { hdr, v2_encode_header(hdr, nick_sender, type, infos, pld_len) },
+            { (void *)payload, pld_len }
+        };
+        if (send_all_iov(sockfd, iov, pld_len > 0 ? 2 : 1) < 0) {
+            perror("Erreur d'envoi du message");
+        }
+        return;
+    }
+
+    struct message msg;
+    memset(&msg, 0, sizeof(struct message));
+    
+    msg.type = type & ~MSG_TYPE_MORE;
+    if (nick_sender) {
+        strncpy(msg.nick_sender, nick_sender, NICK_LEN - 1);
+    }
+    if (infos) {
+        strncpy(msg.infos, infos, INFOS_LEN - 1);
+    }
+    msg.pld_len = pld_len;
+
+    struct iovec iov[2] = {
+        { &msg, sizeof(msg) },
+        { (void *)payload, msg.pld_len }
+    };
+    if (send_all_iov(sockfd, iov, msg.pld_len > 0 ? 2 : 1) < 0) {
+        perror("Erreur d'envoi du message");
+    }
+}
+
+// Envoie un message structuré au serveur ; le payload est une suite
+// quelconque de len octets, envoyée en plusieurs trames si elle dépasse
+// MAX_CHUNK_LEN
+void send_message_to_server(int sockfd, enum msg_type type, const char *nick_sender, 
+                          const char *infos, const char *payload, size_t len) {
+    do {
+        size_t n = len > MAX_CHUNK_LEN ? MAX_CHUNK_LEN : len;
+        enum msg_type chunk_type = n < len ? type | MSG_TYPE_MORE : type;
+        send_frame_to_server(sockfd, chunk_type, nick_sender, infos, payload, n);
+        payload += n;
+        len -= n;
+    } while (len > 0);
+}
+
+// Crée un transfert vers ou depuis peer et l'ajoute à la table
+FileTransfer *new_transfer(enum transfer_dir dir, const char *peer, const char *filename,
+                           const char *file_path) {
+    FileTransfer *transfer = calloc(1, sizeof(FileTransfer));
+    if (!transfer || !(transfer->file_path = strdup(file_path))) {
+        perror("calloc");
+        free(transfer);
+        return NULL;
+    }
+    transfer->id = next_transfer_id++;
+    transfer->dir = dir;
+    strncpy(transfer->peer, peer, NICK_LEN - 1);
+    strncpy(transfer->filename, filename, sizeof(transfer->filename) - 1);
+    transfer->listening_socket = -1;
+    transfer->fd = -1;
+    transfer->part_fd = -1;
+    transfer->pipefd[0] = transfer->pipefd[1] = -1;
+
+    FileTransfer **link = &transfers;
+    while (*link)
+        link = &(*link)->next;
+    *link = transfer;
+    return transfer;
+}
+
+FileTransfer *find_transfer(unsigned int id) {
+    FileTransfer *transfer = transfers;
+    while (transfer && transfer->id != id)
+        transfer = transfer->next;
+    return transfer;
+}
+
+// Plus ancien transfert accepté dans le sens dir avec peer qui porte le
+// numéro id (le nôtre pour un envoi, celui de l'émetteur pour une
+// réception) ; si id vaut 0, le correspondant ne numérote pas ses
+// transferts et le premier venu convient. Seul un transfert qui attend
+// encore la réponse du correspondant, sans flux ouvert, peut convenir : une
+// réponse en double ou sans numéro ne doit ni relancer ni interrompre un
+// transfert en cours, ni une réception dont la réponse n'est pas encore
+// partie.
+FileTransfer *find_peer_transfer(enum transfer_dir dir, const char *peer, unsigned int id) {
+    for (FileTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        unsigned int transfer_id = dir == TRANSFER_UPLOAD ? transfer->id : transfer->peer_id;
+        if (transfer->dir == dir && !transfer->offered && !transfer->hashing && !transfer->ready &&
+            transfer->opened == 0 && (id == 0 || transfer_id == id) &&
+            strcmp(transfer->peer, peer) == 0)
+            return transfer;
+    }
+    return NULL;
+}
+
+// Réception proposée par peer sous son numéro id (0 : la première venue)
+// à laquelle on n'a pas encore répondu
+FileTransfer *find_offer(const char *peer, unsigned int id) {
+    for (FileTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        if (transfer->dir == TRANSFER_DOWNLOAD && (transfer->offered || transfer->hashing) &&
+            (id == 0 || transfer->peer_id == id) && strcmp(transfer->peer, peer) == 0)
+            return transfer;
+    }
+    return NULL;
+}
+
+// Retire un transfert de la table et libère tout ce qu'il tient encore
+void free_transfer(FileTransfer *transfer) {
+    FileTransfer **link = &transfers;
+    while (*link != transfer)
+        link = &(*link)->next;
+    *link = transfer->next;
+
+    if (transfer->listening_socket >= 0)
+        close(transfer->listening_socket);
+    for (int i = 0; i < transfer->opened; i++)
+        close(transfer->streams[i].sock);
+    if (transfer->fd >= 0)
+        close(transfer->fd);
+    if (transfer->part_fd >= 0)
+        close(transfer->part_fd);
+    if (transfer->pipefd[0] >= 0) {
+        close(transfer->pipefd[0]);
+        close(transfer->pipefd[1]);
+    }
+    if (transfer->map)
+        munmap((void *)transfer->map, transfer->total);
+    free(transfer->file_path);
+    free(transfer);
+}
+
+// Millisecondes écoulées sur l'horloge monotone
+long long monotonic_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+//Gère une demande de transfert de fichier. L'offre est mise en attente :
+//l'utilisateur y répond par /accept ou /reject pendant que la boucle de
+//echo_client continue de tourner, faute de quoi elle est refusée au bout
+//de offer_timeout secondes.
+void handle_file_request(const char *sender, const char *filename, unsigned int peer_id) {
+    char file_path[512];
+    snprintf(file_path, sizeof(file_path), "%s/%s", INBOX_DIR, filename);
+    FileTransfer *transfer = new_transfer(TRANSFER_DOWNLOAD, sender, filename, file_path);
+    if (!transfer)
+        return;
+    transfer->peer_id = peer_id;
+    transfer->offered = 1;
+    transfer->expires_ms = monotonic_ms() + offer_timeout * 1000LL;
+
+    printf("%s wants you to accept the transfer of the file named \"%s\". "
+           "Type /accept %u or /reject %u (%d s to answer)\n",
+           sender, filename, transfer->id, transfer->id, offer_timeout);
+}
+
+// Répond au correspondant par FILE_REJECT, avec son numéro de transfert,
+// et oublie l'offre
+void reject_offer(FileTransfer *transfer) {
+    char transfer_tag[32] = "";
+    if (transfer->peer_id)
+        snprintf(transfer_tag, sizeof(transfer_tag), TRANSFER_TAG "%u", transfer->peer_id);
+    send_message_to_server(sockfd, FILE_REJECT, current_nickname, transfer->peer,
+                           transfer_tag, strlen(transfer_tag));
+    free_transfer(transfer);
+}
+
+// Refuse les offres restées sans réponse au-delà de leur délai
+void expire_offers(void) {
+    long long now = monotonic_ms();
+    FileTransfer *transfer = transfers;
+    while (transfer) {
+        FileTransfer *next = transfer->next;
+        if (transfer->offered && now >= transfer->expires_ms) {
+            printf("File offer %u from %s (%s) expired\n", transfer->id, transfer->peer,
+                   transfer->filename);
+            reject_offer(transfer);
+        }
+        transfer = next;
+    }
+}
+
+// Délai de poll() jusqu'à la prochaine expiration d'offre, -1 s'il n'y en a pas
+int next_offer_timeout(void) {
+    long long next = -1, now = monotonic_ms();
+    for (FileTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        if (transfer->offered && (next < 0 || transfer->expires_ms < next))
+            next = transfer->expires_ms;
+    }
+    if (next < 0)
+        return -1;
+    return next > now ? (int)(next - now) : 0;
+}
+
+// Accepte l'offre transfer : on ouvre le socket d'écoute qui recevra ses
+// connexions de données, ou on demande le relais du serveur, et on répond
+// au correspondant par FILE_ACCEPT
+void accept_offer(FileTransfer *transfer) {
+    transfer->offered = 0;
+    ensure_inbox_directory();
+
+    char address_str[128] = {0};
+    if (relay_mode) {
+        // Pas de socket d'écoute : le serveur répondra par l'adresse de
+        // son relais
+        transfer->relayed = 1;
+        strcpy(address_str, RELAY_REQUEST CHECKSUM_TAG);
+    } else {
+        int listening_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (listening_socket < 0) {
+            perror("Socket creation failed");
+            reject_offer(transfer);
+            return;
+        }
+        transfer->listening_socket = listening_socket;
+
+        struct sockaddr_in server_addr;
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = 0;  // Port automatique
+
+        if (bind(listening_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+            perror("Bind failed");
+            reject_offer(transfer);
+            return;
+        }
+
+        if (listen(listening_socket, max_streams) < 0) {
+            perror("Listen failed");
+            reject_offer(transfer);
+            return;
+        }
+
+        socklen_t len = sizeof(server_addr);
+        if (getsockname(listening_socket, (struct sockaddr*)&server_addr, &len) < 0) {
+            perror("getsockname failed");
+            reject_offer(transfer);
+            return;
+        }
+
+        snprintf(address_str, sizeof(address_str), "127.0.0.1:%d/%d" CHECKSUM_TAG,
+                 ntohs(server_addr.sin_port), max_streams);
+    }
+    strcpy(transfer->reply, address_str);
+
+    // Si un transfert précédent a laissé le début du fichier attendu dans
+    // son fichier temporaire, la réponse attend que son CRC32C soit calculé
+    char part_path[512];
+    struct stat st;
+    snprintf(part_path, sizeof(part_path), "%s" PART_SUFFIX, transfer->file_path);
+    transfer->part_fd = open(part_path, O_RDONLY | O_CLOEXEC);
+    if (transfer->part_fd >= 0 && fstat(transfer->part_fd, &st) == 0 && st.st_size > 0) {
+        transfer->hashing = 1;
+        transfer->hash_len = st.st_size;
+        printf("Checking the %lld bytes already received...\n", (long long)st.st_size);
+        return;
+    }
+    send_file_accept(transfer);
+}
+
+// Envoie au correspondant la réponse préparée par accept_offer, avec la
+// demande de reprise si le CRC32C du fichier temporaire a pu être calculé
+void send_file_accept(FileTransfer *transfer) {
+    char *reply = transfer->reply;
+    size_t size = sizeof(transfer->reply);
+    if (transfer->hash_len > 0 && transfer->hash_done == transfer->hash_len) {
+        size_t used = strlen(reply);
+        snprintf(reply + used, size - used, RESUME_TAG "%lld:%08x",
+                 (long long)transfer->hash_len, transfer->hash_crc);
+        transfer->resume_offset = transfer->hash_len;
+        printf("Asking to resume after the %lld bytes already received\n",
+               (long long)transfer->hash_len);
+    }
+    if (transfer->part_fd >= 0) {
+        close(transfer->part_fd);
+        transfer->part_fd = -1;
+    }
+
+    // Le numéro de l'émetteur accompagne notre réponse
+    if (transfer->peer_id) {
+        size_t used = strlen(reply);
+        snprintf(reply + used, size - used, TRANSFER_TAG "%u", transfer->peer_id);
+    }
+    send_message_to_server(sockfd, FILE_ACCEPT, current_nickname, transfer->peer,
+                           reply, strlen(reply));
+}
+
+// Transfert dont le CRC32C d'un début de fichier reste à calculer, NULL
+// s'il n'y en a pas
+FileTransfer *pending_prefix_hash(void) {
+    for (FileTransfer *transfer = transfers; transfer; transfer = transfer->next) {
+        if (transfer->hashing)
+            return transfer;
+    }
+    return NULL;
+}
+
+// Calcule au plus CRC_STEP_SIZE octets de plus du début de fichier de
+// transfer, pour que le chat reste réactif pendant le calcul ; la réponse
+// part, ou l'envoi démarre, une fois le calcul terminé. Une erreur de
+// lecture renonce à la reprise.
+void hash_prefix_step(FileTransfer *transfer) {
+    int upload = transfer->dir == TRANSFER_UPLOAD;
+    off_t len = transfer->hash_len - transfer->hash_done;
+    if (len > CRC_STEP_SIZE)
+        len = CRC_STEP_SIZE;
+    if (crc_file_range(upload ? transfer->fd : transfer->part_fd, upload ? transfer->map : NULL,
+                       transfer->hash_done, len, &transfer->hash_crc) < 0) {
+        transfer->hash_len = 0;
+    } else {
+        transfer->hash_done += len;
+        if (transfer->hash_done < transfer->hash_len)
+            return;
+    }
+    transfer->hashing = 0;
+    if (upload)
+        start_upload(transfer);
+    else
+        send_file_accept(transfer);
+}
+
+//Prépare un fichier pour l'envoi à un destinataire. Vérifie son existence et sa lisibilité, puis ouvre le fichier pour envoyer une demande de transfert au serveur.
+void send_file(const char *recipient, const char *filepath) {
+    printf("Tentative d'envoi du fichier:\n");
+    printf("- Chemin: %s\n", filepath);
+
+    if (access(filepath, F_OK) == -1) {
+        printf("Le fichier n'existe pas: %s\n", strerror(errno));
+        return;
+    }
+
+    if (access(filepath, R_OK) == -1) {
+        printf("Pas de permission de lecture: %s\n", strerror(errno));
+        return;
+    }
+
+    FILE *file = fopen(filepath, "rb");
+    if (!file) {
+        printf("Erreur ouverture fichier: %s\n", strerror(errno));
+        return;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long filesize = ftell(file);
+    rewind(file);
+
+    printf("- Taille: %ld bytes\n", filesize);
+
+    const char *filename = strrchr(filepath, '/');
+    filename = filename ? filename + 1 : filepath;
+
+    printf("- Nom du fichier: %s\n", filename);
+
+    char test_buf[16] = {0};
+    size_t read = fread(test_buf, 1, sizeof(test_buf) - 1, file);
+    printf("- Premier contenu (%zu bytes): %s\n", read, test_buf);
+    rewind(file);
+    fclose(file);
+
+    FileTransfer *transfer = new_transfer(TRANSFER_UPLOAD, recipient, filename, filepath);
+    if (!transfer)
+        return;
+
+    // Nom du fichier, octet nul, puis notre numéro de transfert
+    char request[sizeof(transfer->filename) + 32];
+    size_t len = strlen(transfer->filename) + 1;
+    memcpy(request, transfer->filename, len);
+    len += snprintf(request + len, sizeof(request) - len, TRANSFER_TAG "%u", transfer->id);
+    send_message_to_server(sockfd, FILE_REQUEST, current_nickname, recipient, request, len);
+    printf("Demande de transfert %u envoyée\n", transfer->id);
+}
+
+
+// Tampon de réception partagé par les transferts, aligné sur une page
+char *recv_buffer(void) {
+    static char *buf;
+    if (!buf && posix_memalign((void **)&buf, RECV_BUFFER_ALIGN, RECV_BUFFER_SIZE) != 0) {
+        printf("Cannot allocate receive buffer\n");
+        buf = NULL;
+    }
+    return buf;
+}
+
+// Écrit len octets dans fd à la position offset
+int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Transfère dans le fichier, à la position offset, les n octets présents
+// dans le tube. Si le système de fichiers refuse splice(), le tube est vidé
+// par buf et *use_splice passe à 0 pour la suite du transfert.
+int drain_pipe(int pipe_rd, int fd, off_t offset, size_t n, char *buf, int *use_splice) {
+    while (n > 0) {
+        ssize_t done;
+        if (*use_splice) {
+            done = splice(pipe_rd, NULL, fd, &offset, n, SPLICE_F_MOVE);
+            if (done < 0 && errno == EINVAL) {
+                *use_splice = 0;
+                continue;
+            }
+        } else {
+            done = read(pipe_rd, buf, n < RECV_BUFFER_SIZE ? n : RECV_BUFFER_SIZE);
+            if (done > 0 && pwrite_all(fd, buf, done, offset) < 0)
+                return -1;
+            if (done > 0)
+                offset += done;
+        }
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+            return -1;
+        n -= done;
+    }
+    return 0;
+}
+
+// Décode l'en-tête FILE_SEND d'une connexion de données et en déduit sa
+// plage, le nombre de flux du transfert et la taille totale du fichier
+int parse_stream_header(struct message *msg, FileStream *stream, int *count, size_t *total) {
+    if (msg->type != FILE_SEND || msg->pld_len < 0) {
+        printf("Unexpected message type received\n");
+        return -1;
+    }
+    msg->nick_sender[NICK_LEN - 1] = '\0';
+    msg->infos[INFOS_LEN - 1] = '\0';
+
+    stream->left = msg->pld_len;
+    stream->start = 0;
+    stream->verify = 0;
+    stream->crc = 0;
+    stream->map = NULL;
+    if (strncmp(msg->infos, STREAM_PREFIX, strlen(STREAM_PREFIX)) != 0) {
+        // Émetteur à un seul flux : l'infos est le nom du fichier
+        stream->offset = 0;
+        *count = 1;
+        *total = msg->pld_len;
+        return 0;
+    }
+
+    int index;
+    long long offset, size;
+    if (sscanf(msg->infos + strlen(STREAM_PREFIX), "%d/%d:%lld:%lld",
+               &index, count, &offset, &size) != 4 ||
+        *count < 1 || *count > MAX_STREAMS || index < 0 || index >= *count ||
+        offset < 0 || size < 0 || offset > size - msg->pld_len) {
+        printf("Invalid stream header received\n");
+        return -1;
+    }
+    stream->start = offset;
+    stream->offset = offset;
+    stream->verify = strstr(msg->infos, CHECKSUM_TAG) != NULL;
+    *total = size;
+    return 0;
+}
+
+// Longueur du début du fichier reçu sans trou : les plages complètes qui
+// se suivent depuis base, plus ce qui est arrivé de la première incomplète.
+// Une plage suivie d'un CRC32C ne compte qu'une fois celui-ci vérifié : on
+// ne garde pour la reprise que des octets contrôlés.
+off_t received_prefix(FileStream *streams, int count, off_t base) {
+    off_t prefix = base;
+    for (int found = 1; found; ) {
+        found = 0;
+        for (int i = 0; i < count; i++) {
+            if (streams[i].start == prefix && streams[i].offset > prefix) {
+                if (streams[i].verify && !streams[i].verified)
+                    break;
+                prefix = streams[i].offset;
+                found = streams[i].left == 0;
+                break;
+            }
+        }
+    }
+    return prefix;
+}
+
+// Rattache une connexion de données à la réception transfer ; ses octets
+// seront lus quand poll() les signalera
+int add_download_stream(FileTransfer *transfer, int sock) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (transfer->opened == MAX_STREAMS ||
+        (transfer->count > 0 && transfer->opened == transfer->count) ||
+        flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        close(sock);
+        printf("Unexpected data connection for %s\n", transfer->filename);
+        return -1;
+    }
+    FileStream *stream = &transfer->streams[transfer->opened++];
+    memset(stream, 0, sizeof(*stream));
+    stream->sock = sock;
+    return 0;
+}
+
+// Vérifie que les plages des count flux se suivent de base jusqu'à total,
+// sans trou ni chevauchement
+int streams_tile(const FileStream *streams, int count, off_t base, size_t total) {
+    int used[MAX_STREAMS] = { 0 };
+    off_t end = base;
+    for (int placed = 0; placed < count; placed++) {
+        int next = -1;
+        for (int i = 0; i < count && next < 0; i++) {
+            if (!used[i] && streams[i].start == end)
+                next = i;
+        }
+        if (next < 0)
+            return 0;
+        used[next] = 1;
+        end += streams[next].left;
+    }
+    return (size_t)end == total;
+}
+
+// Tous les en-têtes sont arrivés : on vérifie la reprise demandée par
+// l'émetteur et le découpage de ses plages, puis le fichier est écrit sous
+// un nom temporaire, préalloué à la taille annoncée. Un transfert
+// interrompu laisse dans le fichier temporaire le début reçu sans trou, que
+// le prochain transfert du même fichier pourra reprendre.
+int prepare_download(FileTransfer *transfer) {
+    FileStream *streams = transfer->streams;
+    int count = transfer->count;
+
+    // L'émetteur reprend à l'offset proposé ou repart de zéro
+    off_t base = streams[0].start;
+    for (int i = 1; i < count; i++) {
+        if (streams[i].start < base)
+            base = streams[i].start;
+    }
+    transfer->base = base;
+    transfer->expected = transfer->total - base;
+    if ((base != 0 && base != transfer->resume_offset) ||
+        !streams_tile(streams, count, base, transfer->total)) {
+        printf("Invalid stream header received\n");
+        return -1;
+    }
+    if (transfer->listening_socket >= 0) {
+        close(transfer->listening_socket);
+        transfer->listening_socket = -1;
+    }
+
+    char part_path[512];
+    snprintf(part_path, sizeof(part_path), "%s" PART_SUFFIX, transfer->file_path);
+    transfer->fd = open(part_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (transfer->fd < 0) {
+        printf("Cannot open file for writing\n");
+        return -1;
+    }
+
+    // On ne garde que le début validé par l'émetteur. Réserver la place
+    // d'un coup évite la fragmentation et fait échouer tout de suite un
+    // transfert qui ne tiendrait pas sur le disque.
+    size_t total = transfer->total;
+    if (ftruncate(transfer->fd, base) < 0) {
+        printf("Cannot prepare file: %s\n", strerror(errno));
+        return -1;
+    } else if (total > 0 && fallocate(transfer->fd, 0, 0, total) < 0 &&
+               ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(transfer->fd, total) < 0)) {
+        printf("Cannot preallocate file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Les octets passent du socket au fichier par splice() à travers un
+    // tube, sans copie dans l'espace utilisateur ; à défaut ils sont lus
+    // par morceaux de RECV_BUFFER_SIZE dans le tampon de réception. Ceux
+    // que splice() écrit sans les faire passer par nous sont relus par une
+    // projection du fichier pour leur CRC.
+    transfer->zero_copy = pipe2(transfer->pipefd, O_CLOEXEC) == 0;
+    if (transfer->zero_copy)
+        fcntl(transfer->pipefd[1], F_SETPIPE_SZ, RECV_BUFFER_SIZE);
+    else
+        transfer->pipefd[0] = transfer->pipefd[1] = -1;
+    if (streams[0].verify)
+        transfer->map = map_for_crc(transfer->fd, total);
+    for (int i = 0; i < count; i++)
+        streams[i].map = transfer->map;
+
+    if (base > 0) {
+        printf("Resuming file from %s at byte %lld (%d stream%s)...\n", transfer->peer,
+               (long long)base, count, count > 1 ? "s" : "");
+    } else {
+        printf("Receiving file from %s (%d stream%s)...\n", transfer->peer, count,
+               count > 1 ? "s" : "");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &transfer->start);
+    transfer->ready = 1;
+    return 0;
+}
+
+// Lit la suite de l'en-tête FILE_SEND de stream ; le dernier en-tête
+// attendu déclenche la préparation du fichier
+int read_stream_header(FileTransfer *transfer, FileStream *stream) {
+    ssize_t n = recv(stream->sock, (char *)&stream->hdr + stream->hdr_len,
+                     sizeof(stream->hdr) - stream->hdr_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0) {
+        perror("Failed to receive message header");
+        return -1;
+    }
+    stream->hdr_len += n;
+    if (stream->hdr_len < sizeof(stream->hdr))
+        return 0;
+
+    int count;
+    size_t total;
+    if (parse_stream_header(&stream->hdr, stream, &count, &total) < 0)
+        return -1;
+    if (transfer->count == 0) {
+        transfer->count = count;
+        transfer->total = total;
+    }
+    if (count != transfer->count || total != transfer->total || transfer->opened > count) {
+        printf("Missing or inconsistent stream %d of %d\n", transfer->headers + 1,
+               transfer->count);
+        return -1;
+    }
+    if (++transfer->headers == count)
+        return prepare_download(transfer);
+    return 0;
+}
+
+// Lit le CRC32C envoyé après la plage de stream et le compare à celui des
+// octets reçus. En cas d'écart, la plage entière est considérée comme non
+// reçue.
+int read_stream_trailer(FileStream *stream) {
+    ssize_t n = recv(stream->sock, stream->trailer + stream->trailer_len,
+                     CHECKSUM_LEN - stream->trailer_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0) {
+        printf("Missing checksum after bytes %lld-%lld\n",
+               (long long)stream->start, (long long)stream->offset);
+        return -1;
+    }
+    stream->trailer_len += n;
+    if (stream->trailer_len < CHECKSUM_LEN)
+        return 0;
+
+    const unsigned char *trailer = stream->trailer;
+    uint32_t expected = (uint32_t)trailer[0] << 24 | trailer[1] << 16 | trailer[2] << 8 | trailer[3];
+    if (expected != stream->crc) {
+        printf("Checksum mismatch on bytes %lld-%lld (CRC32C %08x, expected %08x)\n",
+               (long long)stream->start, (long long)stream->offset, stream->crc, expected);
+        stream->offset = stream->start;
+        return -1;
+    }
+    stream->verified = 1;
+    return 0;
+}
+
+// Reçoit ce qui est arrivé sur stream, au plus RECV_BUFFER_SIZE octets pour
+// laisser la main aux autres transferts ; chaque plage est écrite à sa
+// place dans le fichier
+int receive_stream_data(FileTransfer *transfer, FileStream *stream) {
+    if (stream->left == 0)
+        return read_stream_trailer(stream);
+
+    char *buf = recv_buffer();
+    if (!buf)
+        return -1;
+
+    size_t want = stream->left < RECV_BUFFER_SIZE ? stream->left : RECV_BUFFER_SIZE;
+    ssize_t n;
+    if (transfer->zero_copy) {
+        n = splice(stream->sock, NULL, transfer->pipefd[1], NULL, want,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0 && errno == EINVAL) {
+            // Le tube est vide : on passe simplement au tampon
+            transfer->zero_copy = 0;
+            return 0;
+        }
+        // Le CRC relit chaque morceau juste après que splice() l'a écrit
+        // dans le fichier, pendant qu'il est encore dans le cache
+        for (ssize_t done = 0; done < n; ) {
+            size_t piece = stream->verify && n - done > CRC_CHUNK_SIZE ? CRC_CHUNK_SIZE : n - done;
+            if (drain_pipe(transfer->pipefd[0], transfer->fd, stream->offset + done, piece, buf,
+                           &transfer->zero_copy) < 0 ||
+                (stream->verify && crc_file_range(transfer->fd, stream->map, stream->offset + done,
+                                                  piece, &stream->crc) < 0))
+                return -1;
+            done += piece;
+        }
+    } else {
+        n = recv(stream->sock, buf, want, 0);
+        if (n > 0 && pwrite_all(transfer->fd, buf, n, stream->offset) < 0)
+            return -1;
+        if (n > 0 && stream->verify)
+            stream->crc = crc32c_update(stream->crc, buf, n);
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0)
+        return -1;
+    stream->offset += n;
+    stream->left -= n;
+    transfer->transferred += n;
+    return 0;
+}
+
+int stream_done(const FileStream *stream) {
+    return !stream->connecting && stream->out_done == stream->out_len && stream->left == 0 &&
+           (!stream->verify || stream->trailer_len == CHECKSUM_LEN);
+}
+
+int transfer_complete(const FileTransfer *transfer) {
+    if (!transfer->ready)
+        return 0;
+    for (int i = 0; i < transfer->count; i++) {
+        if (!stream_done(&transfer->streams[i]))
+            return 0;
+    }
+    return 1;
+}
+
+// Termine une réception : le fichier complet prend son nom définitif,
+// sinon on ne garde que le début reçu sans trou. Le transfert est ensuite
+// retiré de la table.
+void finish_download(FileTransfer *transfer, int ret) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (transfer->transferred != transfer->expected)
+        ret = -1;
+
+    char part_path[512];
+    snprintf(part_path, sizeof(part_path), "%s" PART_SUFFIX, transfer->file_path);
+    if (transfer->fd < 0) {
+        printf("File transfer %u from %s failed\n", transfer->id, transfer->peer);
+    } else if (ret < 0) {
+        off_t prefix = received_prefix(transfer->streams, transfer->count, transfer->base);
+        if (ftruncate(transfer->fd, prefix) == 0 && prefix > 0) {
+            printf("File transfer failed after %zu of %zu bytes, %lld bytes kept to resume\n",
+                   transfer->transferred, transfer->expected, (long long)prefix);
+        } else {
+            printf("File transfer failed after %zu of %zu bytes\n", transfer->transferred,
+                   transfer->expected);
+            unlink(part_path);
+        }
+    } else {
+        int fd = transfer->fd;
+        transfer->fd = -1;
+        if (close(fd) < 0 || rename(part_path, transfer->file_path) < 0) {
+            printf("Cannot save file: %s\n", strerror(errno));
+            unlink(part_path);
+        } else {
+            double elapsed = (end.tv_sec - transfer->start.tv_sec) +
+                             (end.tv_nsec - transfer->start.tv_nsec) / 1e9;
+            printf("File saved as %s (%zu bytes in %.3f s, %.1f MB/s%s)\n", transfer->file_path,
+                   transfer->transferred, elapsed,
+                   elapsed > 0 ? transfer->transferred / elapsed / 1e6 : 0.0,
+                   transfer->streams[0].verify ? ", CRC32C verified" : "");
+
+            send_message_to_server(sockfd, FILE_ACK, current_nickname, transfer->peer,
+                                   transfer->filename, strlen(transfer->filename));
+        }
+    }
+    free_transfer(transfer);
+}
+
+// Ajoute len octets à ceux que stream doit envoyer
+void queue_stream_output(FileStream *stream, const void *data, size_t len) {
+    memcpy(stream->out + stream->out_len, data, len);
+    stream->out_len += len;
+}
+
+// Termine l'établissement de la connexion de stream puis envoie ce qui
+// reste de stream->out, sans bloquer ; retourne 1 quand tout est parti, 0
+// s'il faut attendre que la socket accepte la suite, -1 en cas d'erreur
+int flush_stream(FileStream *stream) {
+    if (stream->connecting) {
+        int err = 0;
+        socklen_t err_len = sizeof(err);
+        if (getsockopt(stream->sock, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err) {
+            printf("Data connection failed: %s\n", strerror(err ? err : errno));
+            return -1;
+        }
+        stream->connecting = 0;
+    }
+    while (stream->out_done < stream->out_len) {
+        ssize_t n = send(stream->sock, stream->out + stream->out_done,
+                         stream->out_len - stream->out_done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return 0;
+        if (n < 0) {
+            perror("send");
+            return -1;
+        }
+        stream->out_done += n;
+    }
+    return 1;
+}
+
+void finish_transfer(FileTransfer *transfer, int ret) {
+    if (transfer->dir == TRANSFER_UPLOAD)
+        finish_upload(transfer, ret);
+    else
+        finish_download(transfer, ret);
+}
+
+// Traite ce que poll() signale sur une socket de transfer : son socket
+// d'écoute si stream vaut -1, sa connexion de données stream sinon
+void handle_transfer_event(FileTransfer *transfer, int stream) {
+    int ret;
+    if (stream < 0) {
+        int sock = accept(transfer->listening_socket, NULL, NULL);
+        if (sock < 0) {
+            perror("accept");
+            return;
+        }
+        ret = add_download_stream(transfer, sock);
+    } else {
+        FileStream *s = &transfer->streams[stream];
+        ret = flush_stream(s);
+        if (ret > 0 && transfer->dir == TRANSFER_UPLOAD)
+            ret = send_stream_data(transfer, s);
+        else if (ret > 0 && s->hdr_len < sizeof(s->hdr))
+            ret = read_stream_header(transfer, s);
+        else if (ret > 0)
+            ret = receive_stream_data(transfer, s);
+    }
+
+    if (ret < 0)
+        finish_transfer(transfer, -1);
+    else if (transfer_complete(transfer))
+        finish_transfer(transfer, 0);
+}
+
+// Événements à attendre sur la connexion de données stream
+short stream_poll_events(const FileTransfer *transfer, const FileStream *stream) {
+    if (stream->connecting || stream->out_done < stream->out_len)
+        return POLLOUT;
+    if (transfer->dir == TRANSFER_UPLOAD)
+        return stream_done(stream) ? 0 : POLLOUT;
+    if (stream->hdr_len < sizeof(stream->hdr))
+        return POLLIN;
+    // Les données attendent dans le socket que le fichier soit prêt
+    if (!transfer->ready || stream_done(stream))
+        return 0;
+    return POLLIN;
+}
+
+// Décode l'en-tête en tête de buf dans la version parlée par le serveur ;
+// retourne sa taille, 0 s'il est incomplet, -1 s'il est invalide
+int decode_server_header(const char *buf, size_t len, struct message *msg) {
+    if (proto_in == PROTO_V2)
+        return v2_decode_header(buf, len, msg, &nick_dict);
+    if (len < sizeof(struct message))
+        return 0;
+    memcpy(msg, buf, sizeof(struct message));
+    msg->nick_sender[NICK_LEN - 1] = '\0';
+    msg->infos[INFOS_LEN - 1] = '\0';
+    return sizeof(struct message);
+}
+
+// Ajoute un morceau au message en cours de son émetteur. Quand c'est le
+// dernier, retourne 1 et le message complet dans full (full_len octets, à
+// libérer par l'appelant) ; sinon retourne 0.
+int reassemble_chunk(const char *nick, const char *data, size_t len, int more,
+                     char **full, size_t *full_len) {
+    PartialMessage **link = &partial_messages;
+    while (*link && strcmp((*link)->nick, nick) != 0)
+        link = &(*link)->next;
+
+    PartialMessage *partial = *link;
+    if (!partial) {
+        partial = calloc(1, sizeof(PartialMessage));
+        if (!partial) {
+            perror("calloc");
+            return 0;
+        }
+        strncpy(partial->nick, nick, NICK_LEN - 1);
+        *link = partial;
+    }
+
+    char *data_grown = realloc(partial->data, partial->len + len);
+    if (!data_grown && partial->len + len > 0) {
+        perror("realloc");
+        return 0;
+    }
+    memcpy(data_grown + partial->len, data, len);
+    partial->data = data_grown;
+    partial->len += len;
+    if (more)
+        return 0;
+
+    *full = partial->data;
+    *full_len = partial->len;
+    *link = partial->next;
+    free(partial);
+    return 1;
+}
+
+// Lit ce que le serveur a envoyé et traite toutes les trames complètes ; une
+// trame incomplète reste dans inbuf jusqu'à la lecture suivante
+void handle_server_message(int sockfd) {
+    ssize_t received = recv(sockfd, inbuf + inlen, sizeof(inbuf) - inlen, 0);
+    if (received <= 0) {
+        printf("Serveur déconnecté\n");
+        exit(EXIT_FAILURE);
+    }
+    inlen += received;
+
+    size_t off = 0;
+    while (1) {
+        struct message msg;
+        int hdr_len = decode_server_header(inbuf + off, inlen - off, &msg);
+        if (hdr_len == 0)
+            break;
+        if (hdr_len < 0 || msg.pld_len < 0 || msg.pld_len >= BUFFER_SIZE) {
+            printf("Trame invalide reçue du serveur\n");
+            exit(EXIT_FAILURE);
+        }
+        if (inlen - off < hdr_len + (size_t)msg.pld_len)
+            break;
+
+        const char *data = inbuf + off + hdr_len;
+        off += hdr_len + msg.pld_len;
+        int more = msg.type & MSG_TYPE_MORE;
+        msg.type &= ~MSG_TYPE_MORE;
+        if (more || partial_messages) {
+            char *full;
+            size_t full_len;
+            if (reassemble_chunk(msg.nick_sender, data, msg.pld_len, more, &full, &full_len)) {
+                dispatch_server_message(&msg, full, full_len);
+                free(full);
+            }
+            continue;
+        }
+        dispatch_server_message(&msg, data, msg.pld_len);
+    }
+    memmove(inbuf, inbuf + off, inlen - off);
+    inlen -= off;
+}
+
+// Affiche un payload tel quel (octets nuls compris), suivi d'un saut de ligne
+void print_payload(const char *payload, size_t len) {
+    fwrite(payload, 1, len, stdout);
+    putchar('\n');
+}
+
+// Copie un payload dans une chaîne de taille size, tronquée si nécessaire
+void payload_to_string(char *dst, size_t size, const char *payload, size_t len) {
+    if (len >= size)
+        len = size - 1;
+    memcpy(dst, payload, len);
+    dst[len] = '\0';
+}
+
+// Exécute l'action correspondant au type d'un message du serveur ; le
+// payload est une suite quelconque de len octets
+void dispatch_server_message(struct message *msg, const char *payload, size_t len) {
+    // Le serveur annonce la v2 dans son accueil : on la demande, et nos
+    // envois passent en v2 dès la demande partie
+    if (msg->type == ECHO_SEND && strcmp(msg->infos, PROTO_ADVERTISE) == 0 &&
+        proto_out == PROTO_LEGACY) {
+        char version[16];
+        snprintf(version, sizeof(version), "%d", PROTO_V2);
+        send_message_to_server(sockfd, PROTO_NEGOTIATE, "", version, NULL, 0);
+        proto_out = PROTO_V2;
+    }
+
+    switch (msg->type) {
+        case NICKNAME_NEW:
+        case NICKNAME_LIST:
+        case NICKNAME_INFOS:
+        case ECHO_SEND:
+            print_payload(payload, len);
+            break;
+        case UNICAST_SEND:
+            printf("[%s]: ", msg->nick_sender);
+            print_payload(payload, len);
+            break;
+        case BROADCAST_SEND:
+            printf("[%s][All]: ", msg->nick_sender);
+            print_payload(payload, len);
+            break;
+        case MULTICAST_CREATE:
+            printf("[Server] ");
+            print_payload(payload, len);
+            break;
+        case MULTICAST_LIST:
+            fwrite(payload, 1, len, stdout);
+            break;
+        case MULTICAST_JOIN:
+            printf("[%s] ", msg->infos);
+            print_payload(payload, len);
+            break;
+        case MULTICAST_QUIT:
+            printf("[%s] ", msg->infos);
+            print_payload(payload, len);
+            break;
+        case MULTICAST_SEND:
+            printf("[%s][%s] ", msg->infos, msg->nick_sender);
+            print_payload(payload, len);
+            break;
+        case FILE_REQUEST: {
+            if (strcmp(msg->nick_sender, "Server") == 0) {
+                // Le serveur refuse la demande à son infos qui porte le
+                // numéro rappelé
+                char reason[256];
+                payload_to_string(reason, sizeof(reason), payload, len);
+                FileTransfer *transfer = find_peer_transfer(TRANSFER_UPLOAD, msg->infos,
+                                                            transfer_tag_id(reason, strlen(reason)));
+                reason[strcspn(reason, ";")] = '\0';
+                if (transfer) {
+                    printf("[Server] File transfer %u refused: %s\n", transfer->id, reason);
+                    free_transfer(transfer);
+                } else {
+                    printf("[Server] %s\n", reason);
+                }
+                break;
+            }
+            // Le nom du fichier s'arrête à l'octet nul qui précède le
+            // numéro de l'émetteur
+            char filename[256];
+            payload_to_string(filename, sizeof(filename), payload, len);
+            handle_file_request(msg->nick_sender, filename, transfer_tag_id(payload, len));
+            break;
+        }
+        case FILE_ACCEPT: {
+            char address[128];
+            payload_to_string(address, sizeof(address), payload, len);
+            FileTransfer *transfer = find_peer_transfer(TRANSFER_UPLOAD, msg->infos,
+                                                        transfer_tag_id(address, strlen(address)));
+            if (!transfer) {
+                printf("[Server] Unexpected file accept from %s\n", msg->infos);
+                break;
+            }
+            printf("[Server] %s accepted file transfer %u\n", msg->infos, transfer->id);
+            handle_file_accept(transfer, address);
+            break;
+        }
+        case FILE_REJECT: {
+            char reason[256];
+            payload_to_string(reason, sizeof(reason), payload, len);
+            unsigned int id = transfer_tag_id(reason, strlen(reason));
+            reason[strcspn(reason, ";")] = '\0';
+            if (strcmp(msg->nick_sender, "Server") == 0) {
+                // Le serveur abandonne un fichier que l'émetteur infos nous
+                // propose : relais impossible, ou émetteur parti
+                FileTransfer *transfer = find_peer_transfer(TRANSFER_DOWNLOAD, msg->infos, id);
+                if (transfer) {
+                    printf("[Server] Cannot receive file transfer from %s: %s\n", msg->infos, reason);
+                    finish_download(transfer, -1);
+                } else if ((transfer = find_offer(msg->infos, id))) {
+                    printf("[Server] File offer %u from %s withdrawn: %s\n", transfer->id,
+                           msg->infos, reason);
+                    free_transfer(transfer);
+                }
+                break;
+            }
+            FileTransfer *transfer = find_peer_transfer(TRANSFER_UPLOAD, msg->infos, id);
+            if (!transfer) {
+                printf("[Server] %s rejected file transfer\n", msg->infos);
+                break;
+            }
+            printf("[Server] File transfer %u to %s: %s\n", transfer->id, msg->infos, reason);
+            free_transfer(transfer);
+            break;
+        }
+        case FILE_SEND: {
+            // Le relais est prêt pour un fichier que l'on a accepté
+            char address[128];
+            payload_to_string(address, sizeof(address), payload, len);
+            FileTransfer *transfer = find_peer_transfer(TRANSFER_DOWNLOAD, msg->infos,
+                                                        transfer_tag_id(address, strlen(address)));
+            if (!transfer || !transfer->relayed) {
+                printf("Unexpected relay offer from %s\n", msg->infos);
+                break;
+            }
+            handle_relay_ready(transfer, address);
+            break;
+        }
+        case FILE_ACK:
+            printf("[Server] %s has received the file %s\n", msg->nick_sender, msg->infos);
+            break;
+        case PROTO_NEGOTIATE:
+            // Acquittement : les trames suivantes du serveur sont dans la
+            // version qu'il a retenue
+            proto_in = atoi(msg->infos) == PROTO_V2 ? PROTO_V2 : PROTO_LEGACY;
+            break;
+        default:
+            printf("Message de type inconnu reçu\n");
+            break;
+    }
+}
+//Interprète les commandes de l'utilisateur (ex. changement de pseudo, envoi de messages) et gère les transferts de fichiers entrants.
+void echo_client(int sockfd) {
+    char *buff = NULL;      // ligne saisie, de longueur quelconque
+    size_t buff_cap = 0;
+    // STDIN, socket serveur, puis les sockets des transferts : slots[i]
+    // désigne le transfert de fds[i] pour i >= 2
+    struct pollfd *fds = NULL;
+    PollSlot *slots = NULL;
+    size_t fds_cap = 0;
+
+    printf("Connecté au serveur. Tapez /help pour la liste des commandes.\n");
+    ensure_inbox_directory();
+
+    while (1) {
+        size_t needed = 2;
+        for (FileTransfer *t = transfers; t; t = t->next)
+            needed += 1 + t->opened;
+        if (needed > fds_cap) {
+            struct pollfd *fds_grown = realloc(fds, needed * sizeof(*fds));
+            PollSlot *slots_grown = fds_grown ? realloc(slots, needed * sizeof(*slots)) : NULL;
+            if (fds_grown)
+                fds = fds_grown;
+            if (!slots_grown) {
+                perror("realloc");
+                break;
+            }
+            slots = slots_grown;
+            fds_cap = needed;
+        }
+
+        fds[0].fd = STDIN_FILENO;
+        fds[0].events = POLLIN;
+        fds[1].fd = sockfd;
+        fds[1].events = POLLIN;
+        size_t nfds = 2;
+        for (FileTransfer *t = transfers; t; t = t->next) {
+            if (t->listening_socket >= 0) {
+                fds[nfds] = (struct pollfd){ .fd = t->listening_socket, .events = POLLIN };
+                slots[nfds++] = (PollSlot){ t->id, -1 };
+            }
+            for (int i = 0; i < t->opened; i++) {
+                short events = stream_poll_events(t, &t->streams[i]);
+                if (events) {
+                    fds[nfds] = (struct pollfd){ .fd = t->streams[i].sock, .events = events };
+                    slots[nfds++] = (PollSlot){ t->id, i };
+                }
+            }
+        }
+
+        // Pendant le calcul d'un CRC de reprise, poll() ne fait que relever
+        // les événements entre deux étapes du calcul
+        FileTransfer *hashing = pending_prefix_hash();
+        int ret = poll(fds, nfds, hashing ? 0 : next_offer_timeout());
+        if (ret < 0) {
+            perror("poll()");
+            break;
+        }
+        expire_offers();
+        if (hashing)
+            hash_prefix_step(hashing);
+
+        if (fds[0].revents & POLLIN) {
+            // La longueur vient de getline : la ligne peut contenir des
+            // octets nuls, transmis tels quels dans les messages
+            ssize_t line_len = getline(&buff, &buff_cap, stdin);
+            if (line_len < 0) {
+                break;
+            }
+            if (line_len > 0 && buff[line_len - 1] == '\n')
+                buff[--line_len] = '\0';
+
+            if (line_len == 0) {
+                continue;
+            }
+
+            if (strcmp(buff, "/quit") == 0) {
+                printf("Déconnexion...\n");
+                break;
+            } else if (strncmp(buff, "/nick ", 6) == 0) {
+                strncpy(current_nickname, buff + 6, NICK_LEN - 1);
+                send_message_to_server(sockfd, NICKNAME_NEW, "", buff + 6, NULL, 0);
+            } else if (strcmp(buff, "/who") == 0) {
+                send_message_to_server(sockfd, NICKNAME_LIST, "", NULL, NULL, 0);
+            } else if (strncmp(buff, "/whois ", 7) == 0) {
+                send_message_to_server(sockfd, NICKNAME_INFOS, "", buff + 7, NULL, 0);
+            } else if (strncmp(buff, "/msgall ", 8) == 0) {
+                send_message_to_server(sockfd, BROADCAST_SEND, "", NULL, buff + 8, line_len - 8);
+            } else if (strncmp(buff, "/msg ", 5) == 0) {
+                char *recipient = strtok(buff + 5, " ");
+                char *message = strtok(NULL, "");
+                if (recipient && message) {
+                    send_message_to_server(sockfd, UNICAST_SEND, "", recipient,
+                                           message, line_len - (message - buff));
+                } else {
+                    printf("Usage: /msg <pseudo> <message>\n");
+                }
+            } else if (strncmp(buff, "/create ", 8) == 0) {
+                send_message_to_server(sockfd, MULTICAST_CREATE, "", buff + 8, NULL, 0);
+            } else if (strcmp(buff, "/channel_list") == 0) {
+                send_message_to_server(sockfd, MULTICAST_LIST, "", NULL, NULL, 0);
+            } else if (strncmp(buff, "/join ", 6) == 0) {
+                send_message_to_server(sockfd, MULTICAST_JOIN, "", buff + 6, NULL, 0);
+            } else if (strncmp(buff, "/quit ", 6) == 0) {
+                send_message_to_server(sockfd, MULTICAST_QUIT, "", buff + 6, NULL, 0);
+            } else if (strncmp(buff, "/send ", 6) == 0) {
+                char *recipient = strtok(buff + 6, " ");
+                char *filepath = strtok(NULL, "");
+                if (recipient && filepath) {
+                    // Supprimer les espaces au début du filepath
+                    while (*filepath == ' ') filepath++;
+                    // Supprimer les guillemets si présents
+                    if (filepath[0] == '"') {
+                        filepath++;
+                        size_t len = strlen(filepath);
+                        if (len > 0 && filepath[len-1] == '"') {
+                            filepath[len-1] = '\0';
+                        }
+                    }
+                    if (test_file(filepath) == 0) {
+                        send_file(recipient, filepath);
+                    }
+                } else {
+                    printf("Usage: /send <username> <filepath>\n");
+                }
+            } else if (strncmp(buff, "/accept ", 8) == 0 || strncmp(buff, "/reject ", 8) == 0) {
+                FileTransfer *t = find_transfer(strtoul(buff + 8, NULL, 10));
+                if (!t || !t->offered)
+                    printf("No pending file offer %s\n", buff + 8);
+                else if (buff[1] == 'a')
+                    accept_offer(t);
+                else
+                    reject_offer(t);
+            } else if (strcmp(buff, "/help") == 0) {
+                printf("Commandes disponibles:\n");
+                printf("/nick <pseudo> : définir son pseudo\n");
+                printf("/who : liste des utilisateurs connectés\n");
+                printf("/whois <pseudo> : informations sur un utilisateur\n");
+                printf("/msgall <message> : envoyer un message à tous\n");
+                printf("/msg <pseudo> <message> : envoyer un message privé\n");
+                printf("/create <channel> : créer un salon\n");
+                printf("/channel_list : liste des salons\n");
+                printf("/join <channel> : rejoindre un salon\n");
+                printf("/quit <channel> : quitter un salon\n");
+                printf("/send <pseudo> <filepath> : envoyer un fichier\n");
+                printf("/accept <id> : accepter une offre de fichier\n");
+                printf("/reject <id> : refuser une offre de fichier\n");
+                printf("/quit : quitter le chat\n");
+            } else {
+                // Message pour le salon actuel
+                send_message_to_server(sockfd, MULTICAST_SEND, "", NULL, buff, line_len);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) {
+            handle_server_message(sockfd);
+        }
+
+        // Connexions et données des transferts. Un transfert a pu se
+        // terminer depuis la construction de fds : on le retrouve par son
+        // numéro et on vérifie que la socket est toujours la sienne.
+        for (size_t i = 2; i < nfds; i++) {
+            if (!fds[i].revents)
+                continue;
+            FileTransfer *t = find_transfer(slots[i].id);
+            int stream = slots[i].stream;
+            if (t && (stream < 0 ? t->listening_socket == fds[i].fd
+                                 : stream < t->opened && t->streams[stream].sock == fds[i].fd))
+                handle_transfer_event(t, stream);
+        }
+    }
+    free(fds);
+    free(slots);
+    free(buff);
+}
+// Adresse de la connexion de données décrite par address : le socket
+// d'écoute du destinataire ("<ip>:<port>"), ou le relais du serveur
+// ("relay:<port>:<jeton>"). Pour le relais, hello reçoit le jeton suivi de
+// role (RELAY_HELLO_LEN octets), à envoyer en premier. Retourne 1 pour le
+// relais, 0 en direct, -1 si l'adresse est invalide.
+int data_address(const char *address, char role, struct sockaddr_storage *addr,
+                 socklen_t *addr_len, char *hello) {
+    memset(addr, 0, sizeof(*addr));
+    if (strncmp(address, RELAY_PREFIX, strlen(RELAY_PREFIX)) == 0) {
+        int port;
+        char token[RELAY_TOKEN_LEN + 1];
+        if (sscanf(address, RELAY_PREFIX "%d:%16s", &port, token) != 2 ||
+            strlen(token) != RELAY_TOKEN_LEN) {
+            printf("Invalid relay address received\n");
+            return -1;
+        }
+        memcpy(hello, token, RELAY_TOKEN_LEN);
+        hello[RELAY_TOKEN_LEN] = role;
+
+        // Le relais écoute sur l'hôte du serveur
+        *addr_len = sizeof(*addr);
+        if (getpeername(sockfd, (struct sockaddr *)addr, addr_len) < 0) {
+            perror("getpeername");
+            return -1;
+        }
+        if (addr->ss_family == AF_INET6)
+            ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+        else
+            ((struct sockaddr_in *)addr)->sin_port = htons(port);
+        return 1;
+    }
+
+    char ip[16];
+    int port;
+    if (sscanf(address, "%15[^:]:%d", ip, &port) != 2) {
+        printf("Invalid address format received\n");
+        return -1;
+    }
+    struct sockaddr_in *in = (struct sockaddr_in *)addr;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &in->sin_addr) <= 0) {
+        printf("Invalid IP address\n");
+        return -1;
+    }
+    *addr_len = sizeof(*in);
+    return 0;
+}
+
+// Ouvre vers addr la connexion de données stream sans attendre qu'elle
+// soit établie : poll() le signalera
+int start_connect(FileStream *stream, const struct sockaddr_storage *addr, socklen_t addr_len) {
+    stream->sock = socket(addr->ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (stream->sock < 0) {
+        perror("Socket creation failed");
+        return -1;
+    }
+    if (connect(stream->sock, (const struct sockaddr *)addr, addr_len) < 0) {
+        if (errno != EINPROGRESS) {
+            perror("Connection failed");
+            close(stream->sock);
+            stream->sock = -1;
+            return -1;
+        }
+        stream->connecting = 1;
+    }
+    return 0;
+}
+
+// Le serveur relaie le fichier que l'on a accepté : on se connecte à son
+// relais pour le recevoir
+void handle_relay_ready(FileTransfer *transfer, const char *address) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char hello[RELAY_HELLO_LEN];
+    FileStream stream = { 0 };
+    if (data_address(address, RELAY_ROLE_RECEIVER, &addr, &addr_len, hello) != 1 ||
+        start_connect(&stream, &addr, addr_len) < 0 ||
+        add_download_stream(transfer, stream.sock) < 0) {
+        finish_download(transfer, -1);
+        return;
+    }
+    FileStream *added = &transfer->streams[transfer->opened - 1];
+    added->connecting = stream.connecting;
+    queue_stream_output(added, hello, RELAY_HELLO_LEN);
+}
+
+// Met en attente l'en-tête FILE_SEND d'une connexion de données
+void queue_stream_header(FileStream *stream, const char *infos, size_t len) {
+    struct message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = FILE_SEND;
+    snprintf(msg.nick_sender, NICK_LEN, "%s", current_nickname);
+    snprintf(msg.infos, INFOS_LEN, "%s", infos);
+    msg.pld_len = len;
+    queue_stream_output(stream, &msg, sizeof(msg));
+}
+
+// Nombre de flux à ouvrir vers un destinataire qui en accepte au plus
+// "/<flux>" dans son adresse : pas plus que notre propre limite, et pas de
+// plage plus petite que MIN_STREAM_BYTES
+int negotiate_streams(const char *address_port, off_t size) {
+    const char *slash = strchr(address_port, '/');
+    int streams = slash ? atoi(slash + 1) : 1;
+    if (streams > max_streams)
+        streams = max_streams;
+    if (streams > size / MIN_STREAM_BYTES)
+        streams = size / MIN_STREAM_BYTES;
+    return streams < 1 ? 1 : streams;
+}
+
+// Envoie la suite de la plage de stream, autant que la socket en accepte.
+// sendfile() y pousse les octets sans copie dans l'espace utilisateur ; si
+// le noyau ne le permet pas pour ce fichier, ils sont lus par morceaux de
+// FILE_CHUNK_SIZE et seule la partie envoyée compte. Avec verify, le CRC32C
+// de la plage est mis en attente à sa suite : ses octets sont lus par
+// morceaux d'au plus CRC_CHUNK_SIZE, jusqu'à la prochaine frontière de
+// bloc, juste avant que sendfile() ne les envoie, quand il ne reste plus
+// d'octets comptés à envoyer. Le CRC avance ainsi au rythme de l'envoi, sur
+// des octets que sendfile() trouve ensuite dans le cache de pages.
+int send_stream_data(FileTransfer *transfer, FileStream *stream) {
+    if (stream->left > 0) {
+        ssize_t n;
+        if (transfer->zero_copy) {
+            size_t chunk = stream->left < SENDFILE_MAX ? stream->left : SENDFILE_MAX;
+            if (stream->verify) {
+                if (stream->crc_to == stream->offset) {
+                    off_t end = stream->offset + stream->left;
+                    off_t to = (stream->crc_to / CRC_CHUNK_SIZE + 1) * CRC_CHUNK_SIZE;
+                    if (to > end)
+                        to = end;
+                    if (crc_file_range(transfer->fd, transfer->map, stream->crc_to,
+                                       to - stream->crc_to, &stream->crc) < 0)
+                        return -1;
+                    stream->crc_to = to;
+                }
+                if (chunk > (size_t)(stream->crc_to - stream->offset))
+                    chunk = stream->crc_to - stream->offset;
+            }
+            n = sendfile(stream->sock, transfer->fd, &stream->offset, chunk);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) {
+                transfer->zero_copy = 0;
+                return 0;
+            }
+        } else {
+            char buffer[FILE_CHUNK_SIZE];
+            ssize_t got = pread(transfer->fd, buffer,
+                                stream->left < sizeof(buffer) ? stream->left : sizeof(buffer),
+                                stream->offset);
+            if (got <= 0) {
+                n = got;
+            } else {
+                n = send(stream->sock, buffer, got, MSG_NOSIGNAL);
+                // Les octets déjà comptés avant que sendfile() n'échoue ne
+                // le sont pas une seconde fois
+                if (n > 0 && stream->verify && stream->offset + n > stream->crc_to) {
+                    size_t counted = stream->crc_to - stream->offset;
+                    stream->crc = crc32c_update(stream->crc, buffer + counted, n - counted);
+                    stream->crc_to = stream->offset + n;
+                }
+                if (n > 0)
+                    stream->offset += n;
+            }
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        if (n == 0)
+            errno = EIO;    // fichier tronqué pendant l'envoi
+        if (n <= 0) {
+            perror("Failed to send file");
+            return -1;
+        }
+        stream->left -= n;
+        transfer->transferred += n;
+    }
+
+    if (stream->left == 0 && stream->verify && stream->trailer_len == 0) {
+        unsigned char *trailer = stream->trailer;
+        trailer[0] = stream->crc >> 24;
+        trailer[1] = stream->crc >> 16;
+        trailer[2] = stream->crc >> 8;
+        trailer[3] = stream->crc;
+        stream->trailer_len = CHECKSUM_LEN;
+        stream->out_len = stream->out_done = 0;
+        queue_stream_output(stream, trailer, CHECKSUM_LEN);
+        return flush_stream(stream) < 0 ? -1 : 0;
+    }
+    return 0;
+}
+
+// Termine un envoi et le retire de la table
+void finish_upload(FileTransfer *transfer, int ret) {
+    if (ret == 0 && transfer->transferred == transfer->expected) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double elapsed = (end.tv_sec - transfer->start.tv_sec) +
+                         (end.tv_nsec - transfer->start.tv_nsec) / 1e9;
+        printf("File %s sent successfully to %s (%zu bytes in %.3f s, %.1f MB/s)\n",
+               transfer->filename, transfer->peer, transfer->transferred, elapsed,
+               elapsed > 0 ? transfer->transferred / elapsed / 1e6 : 0.0);
+    } else {
+        printf("Failed to send file %s to %s\n", transfer->filename, transfer->peer);
+    }
+    free_transfer(transfer);
+}
+
+// Lit dans address la demande de reprise RESUME_TAG "<offset>:<crc>" du
+// destinataire ; retourne 0 s'il n'y en a pas
+int parse_resume_offer(const char *address, long long *offset, uint32_t *crc) {
+    const char *tag = strstr(address, RESUME_TAG);
+    return tag && sscanf(tag + strlen(RESUME_TAG), "%lld:%x", offset, crc) == 2;
+}
+
+// Offset à partir duquel envoyer le fichier de transfer : celui de la
+// demande de reprise du destinataire si le début de notre fichier, haché
+// par hash_prefix_step(), a le même CRC32C ; 0 sinon
+off_t resume_offset(FileTransfer *transfer) {
+    long long offset;
+    uint32_t crc;
+    if (!parse_resume_offer(transfer->reply, &offset, &crc))
+        return 0;
+    if (transfer->hash_len == 0 || transfer->hash_done != transfer->hash_len ||
+        offset != transfer->hash_len || crc != transfer->hash_crc) {
+        printf("Receiver's partial copy does not match, sending the whole file\n");
+        return 0;
+    }
+    return offset;
+}
+
+// Le destinataire a accepté le fichier de transfer : on l'ouvre, puis
+// l'envoi démarre, après le calcul par étapes du CRC32C du début proposé
+// en reprise s'il y en a un
+void handle_file_accept(FileTransfer *transfer, const char *address_port) {
+    struct stat st;
+    transfer->fd = open(transfer->file_path, O_RDONLY | O_CLOEXEC);
+    if (transfer->fd < 0 || fstat(transfer->fd, &st) < 0) {
+        printf("Cannot open file for sending\n");
+        finish_upload(transfer, -1);
+        return;
+    }
+    transfer->total = st.st_size;
+    snprintf(transfer->reply, sizeof(transfer->reply), "%s", address_port);
+
+    // Le destinataire vérifie le contenu : chaque plage est suivie de son
+    // CRC32C
+    if (strstr(address_port, CHECKSUM_TAG))
+        transfer->map = map_for_crc(transfer->fd, st.st_size);
+
+    long long offset;
+    uint32_t crc;
+    if (parse_resume_offer(address_port, &offset, &crc) && offset > 0 && offset <= st.st_size) {
+        transfer->hashing = 1;
+        transfer->hash_len = offset;
+        return;
+    }
+    start_upload(transfer);
+}
+
+//Gère la connexion au destinataire pour le transfert de fichiers une fois
+//que l'autre côté a accepté. Le fichier part à partir de base sur count
+//connexions vers le destinataire (ou une vers le relais), une plage
+//contiguë par connexion ; les connexions sont ouvertes sans attendre, puis
+//poll() désigne dans echo_client celles qui peuvent écrire.
+void start_upload(FileTransfer *transfer) {
+    const char *receiver = transfer->peer;
+    const char *address_port = transfer->reply;
+    off_t size = transfer->total;
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    char hello[RELAY_HELLO_LEN];
+    int relayed = data_address(address_port, RELAY_ROLE_SENDER, &addr, &addr_len, hello);
+    if (relayed < 0) {
+        finish_upload(transfer, -1);
+        return;
+    }
+
+    int verify = strstr(address_port, CHECKSUM_TAG) != NULL;
+    off_t base = resume_offset(transfer);
+    int count = relayed ? 1 : negotiate_streams(address_port, size - base);
+    if (size - base > (off_t)count * INT32_MAX) {
+        // La taille de chaque plage part dans le champ pld_len de l'en-tête
+        printf("File too large to send (%lld bytes)\n", (long long)size);
+        finish_upload(transfer, -1);
+        return;
+    }
+    if (base > 0)
+        printf("Resuming transfer at byte %lld of %lld\n", (long long)base, (long long)size);
+
+    // Sans plusieurs flux, reprise ni contrôle, un destinataire peut être
+    // ancien : l'en-tête de l'unique flux porte le nom du fichier
+    int legacy = count == 1 && base == 0 && !verify;
+
+    if (count > 1)
+        printf("Sending file to %s over %d streams...\n", receiver, count);
+    else
+        printf(relayed ? "Sending file to %s through server relay...\n"
+                       : "Sending file to %s...\n", receiver);
+
+    transfer->relayed = relayed;
+    transfer->base = base;
+    transfer->expected = size - base;
+    transfer->count = count;
+    transfer->zero_copy = 1;
+    for (; transfer->opened < count; transfer->opened++) {
+        FileStream *stream = &transfer->streams[transfer->opened];
+        int i = transfer->opened;
+        memset(stream, 0, sizeof(*stream));
+        stream->start = base + (size - base) * i / count;
+        stream->offset = stream->crc_to = stream->start;
+        stream->left = base + (size - base) * (i + 1) / count - stream->offset;
+        stream->verify = verify;
+        if (start_connect(stream, &addr, addr_len) < 0) {
+            finish_upload(transfer, -1);
+            return;
+        }
+
+        char infos[INFOS_LEN];
+        snprintf(infos, sizeof(infos), STREAM_PREFIX "%d/%d:%lld:%lld%s", i, count,
+                 (long long)stream->offset, (long long)size, verify ? CHECKSUM_TAG : "");
+        if (relayed)
+            queue_stream_output(stream, hello, RELAY_HELLO_LEN);
+        queue_stream_header(stream, legacy ? transfer->filename : infos, stream->left);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &transfer->start);
+    transfer->ready = 1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "rs:t:")) != -1) {
+        if (opt == 'r') {
+            relay_mode = 1;
+        } else if (opt == 's' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_STREAMS) {
+            max_streams = atoi(optarg);
+        } else if (opt == 't' && atoi(optarg) >= 1) {
+            offer_timeout = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-r] [-s streams] [-t offer_timeout] <server_name> <server_port>\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-r] [-s streams] [-t offer_timeout] <server_name> <server_port>\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Un destinataire qui ferme pendant un envoi ne doit pas tuer le client
+    signal(SIGPIPE, SIG_IGN);
+
+    sockfd = handle_connect(argv[optind], argv[optind + 1]);
+    printf("Connecté au serveur %s:%s\n", argv[optind], argv[optind + 1]);
+
+    echo_client(sockfd);
+
+    // Les réceptions interrompues gardent leur début pour une reprise ; le
+    // serveur oublie de lui-même les offres sans réponse
+    while (transfers) {
+        if (transfers->dir == TRANSFER_DOWNLOAD && !transfers->offered && !transfers->hashing)
+            finish_download(transfers, -1);
+        else
+            free_transfer(transfers);
+    }
+    close(sockfd);
+    return EXIT_SUCCESS;
 }
\ No newline at end of file
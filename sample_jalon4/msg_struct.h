@@ -50,6 +50,10 @@ static char* msg_type_str[] = {
 #ifndef MSG_STRUCT_H
 #define MSG_STRUCT_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
 #define NICK_LEN 128
 #define INFOS_LEN 128
 
@@ -69,7 +73,8 @@ enum msg_type {
     FILE_ACCEPT,
     FILE_REJECT,
     FILE_SEND,
-    FILE_ACK
+    FILE_ACK,
+    PROTO_NEGOTIATE
 };
 
 struct message {
@@ -79,6 +84,230 @@ struct message {
     char infos[INFOS_LEN];
 };
 
+// Protocole v2 : en-tête compact de taille variable
+//
+//   u8 nick_len | nick | u8 type | u8 infos_len | infos | varint pld_len
+//
+// pld_len est codé en varint (7 bits par octet, poids faible en premier).
+// Le serveur annonce la v2 dans l'infos de son message d'accueil ; le client
+// répond par un PROTO_NEGOTIATE au format historique puis parle v2, et le
+// serveur passe en v2 après son propre PROTO_NEGOTIATE d'acquittement.
+//
+// Dans les trames du serveur, l'octet nick_len peut aussi désigner une
+// entrée du dictionnaire de pseudos propre à la connexion :
+//   0x80 | id              pseudo de l'entrée id
+//   0xFF id nick_len nick  l'entrée id devient nick, puis pseudo littéral
+// Le dictionnaire compte NICK_DICT_SIZE entrées ; le serveur décide seul de
+// leur remplacement, le client se contente d'appliquer les définitions.
+//
+// Un message plus long que MAX_CHUNK_LEN est envoyé en plusieurs trames :
+// toutes sauf la dernière portent MSG_TYPE_MORE dans leur type. Le drapeau
+// n'existe qu'en v2 ; un client historique reçoit des messages distincts.
+#define PROTO_LEGACY 1
+#define PROTO_V2 2
+#define PROTO_ADVERTISE "proto=2"
+#define VARINT_MAX 5
+#define V2_HEADER_MAX (1 + (NICK_LEN - 1) + 1 + 1 + (INFOS_LEN - 1) + VARINT_MAX)
+#define NICK_DICT_SIZE 64
+#define NICK_REF 0x80
+#define NICK_DEF 0xFF
+#define MAX_CHUNK_LEN 1023
+#define MSG_TYPE_MORE 0x80
+
+// Relais de fichiers par le serveur
+//
+// Le destinataire qui accepte un fichier peut répondre RELAY_REQUEST au lieu
+// d'une adresse. Si le serveur relaie, l'émetteur reçoit en FILE_ACCEPT et
+// le destinataire en FILE_SEND l'adresse "relay:<port>:<jeton>". Chacun
+// ouvre une connexion de données vers ce port de l'hôte du serveur et y
+// écrit d'abord le jeton suivi de son rôle (RELAY_HELLO_LEN octets) ; le
+// transfert se déroule ensuite comme en direct. Une connexion de données
+// qui n'a pas écrit son jeton au bout de RELAY_CONNECT_TIMEOUT_MS est
+// fermée, comme l'est un relais dont les deux connexions ne sont pas
+// arrivées dans ce délai. Si le serveur ne peut pas relayer, l'émetteur
+// reçoit un FILE_REJECT du destinataire et le destinataire un FILE_REJECT
+// de "Server" dont l'infos est le pseudo de l'émetteur, avec le numéro du
+// transfert.
+#define RELAY_REQUEST "relay"
+#define RELAY_PREFIX "relay:"
+#define RELAY_TOKEN_LEN 16
+#define RELAY_HELLO_LEN (RELAY_TOKEN_LEN + 1)
+#define RELAY_ROLE_SENDER 'S'
+#define RELAY_ROLE_RECEIVER 'R'
+#define RELAY_CONNECT_TIMEOUT_MS 30000
+
+// Transfert en plusieurs flux
+//
+// Le destinataire annonce dans FILE_ACCEPT le nombre de connexions de
+// données qu'il accepte : "<ip>:<port>/<flux>". L'émetteur découpe alors le
+// fichier en plages contiguës, une par connexion ; l'en-tête FILE_SEND de
+// chacune porte dans son infos "stream:<indice>/<flux>:<offset>:<taille
+// totale>" et dans pld_len la longueur de sa plage. Sans "/<flux>" (ancien
+// destinataire ou relais), l'émetteur envoie un seul flux dont l'infos est
+// le nom du fichier, comme avant.
+#define STREAM_PREFIX "stream:"
+#define MAX_STREAMS 16
+
+// Reprise d'un transfert interrompu
+//
+// Un destinataire qui garde le début d'un fichier d'un transfert précédent
+// ajoute à son adresse (ou à RELAY_REQUEST) RESUME_TAG "<offset>:<crc>",
+// où crc est le CRC32C des offset premiers octets, en hexadécimal. Le
+// serveur recopie ce suffixe à la fin de l'adresse du relais. Si le début
+// de son fichier a le même CRC32C, l'émetteur n'envoie que la suite : ses
+// en-têtes sont alors toujours au format "stream:" et leurs plages
+// commencent à offset. Sinon il envoie tout le fichier depuis l'offset 0.
+#define RESUME_TAG ";resume="
+
+// Contrôle d'intégrité
+//
+// Un destinataire qui vérifie ce qu'il reçoit ajoute CHECKSUM_TAG à son
+// adresse (ou à RELAY_REQUEST). L'émetteur qui le prend en charge envoie
+// alors toujours des en-têtes "stream:", terminés eux aussi par
+// CHECKSUM_TAG, et fait suivre chaque plage du CRC32C de ses octets sur
+// CHECKSUM_LEN octets (poids fort en premier).
+#define CHECKSUM_TAG ";crc32c"
+#define CHECKSUM_LEN 4
+
+// Transferts simultanés
+//
+// Un client peut avoir plusieurs transferts en cours avec le même
+// correspondant : l'émetteur numérote les siens. Le payload de sa
+// FILE_REQUEST est le nom du fichier suivi d'un octet nul puis de
+// TRANSFER_TAG "<numéro>" ; un ancien destinataire n'en voit que le nom. Le
+// destinataire rappelle ce numéro en ajoutant la même balise à son adresse
+// (ou à RELAY_REQUEST) et en payload de son FILE_REJECT. Le serveur s'en
+// sert pour retrouver la demande et le transmet à l'émetteur avec la
+// réponse. Sans numéro, la demande est retrouvée par les seuls pseudos. Le
+// serveur qui refuse une demande répond par un FILE_REQUEST de "Server"
+// dont l'infos est le destinataire demandé et dont le payload, le motif,
+// se termine par le même numéro. Une demande encore sans réponse est
+// abandonnée si l'émetteur ou le destinataire part ou change de pseudo :
+// l'émetteur reçoit alors un FILE_REJECT du destinataire, le destinataire
+// un FILE_REJECT de "Server" dont l'infos est l'émetteur, chacun avec le
+// numéro du transfert.
+#define TRANSFER_TAG ";id="
+
+// Dictionnaire de pseudos d'une connexion, côté récepteur
+struct nick_dict {
+    char names[NICK_DICT_SIZE][NICK_LEN];
+};
+
+static inline size_t v2_header_size(size_t nick_len, size_t infos_len, uint32_t pld_len) {
+    size_t size = 1 + nick_len + 1 + 1 + infos_len + 1;
+    while (pld_len >= 0x80) {
+        pld_len >>= 7;
+        size++;
+    }
+    return size;
+}
+
+// Écrit l'en-tête dans buf (au moins V2_HEADER_MAX octets) et retourne sa
+// taille ; nick et infos sont tronqués comme dans struct message
+static inline size_t v2_encode_header(char *buf, const char *nick, enum msg_type type,
+                                      const char *infos, uint32_t pld_len) {
+    size_t nick_len = nick ? strnlen(nick, NICK_LEN - 1) : 0;
+    size_t infos_len = infos ? strnlen(infos, INFOS_LEN - 1) : 0;
+    unsigned char *p = (unsigned char *)buf;
+
+    *p++ = nick_len;
+    memcpy(p, nick, nick_len);
+    p += nick_len;
+    *p++ = type;
+    *p++ = infos_len;
+    memcpy(p, infos, infos_len);
+    p += infos_len;
+    while (pld_len >= 0x80) {
+        *p++ = (pld_len & 0x7f) | 0x80;
+        pld_len >>= 7;
+    }
+    *p++ = pld_len;
+    return (char *)p - buf;
+}
+
+// Décode un en-tête v2 dans msg ; retourne sa taille, 0 s'il est encore
+// incomplet, -1 s'il est invalide. Sans dictionnaire (dict NULL), seuls les
+// pseudos littéraux sont acceptés. Une définition n'est enregistrée dans le
+// dictionnaire qu'une fois l'en-tête complet.
+static inline int v2_decode_header(const char *buf, size_t len, struct message *msg,
+                                   struct nick_dict *dict) {
+    const unsigned char *p = (const unsigned char *)buf;
+    const unsigned char *end = p + len;
+    int def_id = -1;
+
+    if (p == end)
+        return 0;
+    size_t nick_len = *p++;
+    if (nick_len == NICK_DEF) {
+        if ((size_t)(end - p) < 2)
+            return 0;
+        def_id = *p++;
+        nick_len = *p++;
+        if (!dict || def_id >= NICK_DICT_SIZE || nick_len >= NICK_REF)
+            return -1;
+    }
+
+    if (nick_len >= NICK_REF) {
+        size_t id = nick_len & ~NICK_REF;
+        if (!dict || id >= NICK_DICT_SIZE)
+            return -1;
+        if ((size_t)(end - p) < 2)
+            return 0;
+        strcpy(msg->nick_sender, dict->names[id]);
+    } else {
+        if ((size_t)(end - p) < nick_len + 2)
+            return 0;
+        memcpy(msg->nick_sender, p, nick_len);
+        msg->nick_sender[nick_len] = '\0';
+        p += nick_len;
+    }
+    msg->type = *p++;
+
+    size_t infos_len = *p++;
+    if (infos_len >= INFOS_LEN)
+        return -1;
+    if ((size_t)(end - p) < infos_len)
+        return 0;
+    memcpy(msg->infos, p, infos_len);
+    msg->infos[infos_len] = '\0';
+    p += infos_len;
+
+    uint32_t pld_len = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (p == end)
+            return 0;
+        if (shift == 7 * VARINT_MAX)
+            return -1;
+        unsigned char byte = *p++;
+        if (shift == 28 && (byte & 0x70))
+            return -1;
+        pld_len |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    if (pld_len > INT32_MAX)
+        return -1;
+    msg->pld_len = pld_len;
+    if (def_id >= 0)
+        strcpy(dict->names[def_id], msg->nick_sender);
+    return (const char *)p - buf;
+}
+
+// Numéro de transfert que porte buf (len octets) après TRANSFER_TAG, 0 s'il
+// n'y en a pas
+static inline unsigned int transfer_tag_id(const char *buf, size_t len) {
+    size_t tag_len = strlen(TRANSFER_TAG);
+    for (size_t i = 0; i + tag_len <= len; i++) {
+        if (memcmp(buf + i, TRANSFER_TAG, tag_len) != 0)
+            continue;
+        unsigned int id = 0;
+        for (i += tag_len; i < len && buf[i] >= '0' && buf[i] <= '9'; i++)
+            id = id * 10 + (buf[i] - '0');
+        return id;
+    }
+    return 0;
+}
+
 #ifdef MSG_STRUCT_IMPL
 static char* msg_type_str[] = {
     "NICKNAME_NEW",
@@ -96,7 +325,8 @@ static char* msg_type_str[] = {
     "FILE_ACCEPT",
     "FILE_REJECT",
     "FILE_SEND",
-    "FILE_ACK"
+    "FILE_ACK",
+    "PROTO_NEGOTIATE"
 };
 #endif
 
@@ -1,722 +1,2667 @@
-#include <arpa/inet.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <unistd.h>
-#include <poll.h>
-#include <time.h>
-#include "msg_struct.h"
-
-#define MAX_CLIENTS 10
-#define MAX_CHANNELS 100
-#define CHANNEL_NAME_LEN 50
-#define PAYLOAD_SIZE 1024
-
-// Structures existantes
-typedef struct Client {
-    int fd;
-    struct sockaddr_in addr;
-    char nickname[NICK_LEN];
-    time_t connection_time;
-    char current_channel[CHANNEL_NAME_LEN];
-    struct Client *next;
-} Client;
-
-typedef struct Channel {
-    char name[CHANNEL_NAME_LEN];
-    int num_users;
-    struct Channel *next;
-} Channel;
-
-// Nouvelle structure pour le jalon 4
-typedef struct FileTransfer {
-    char sender_nick[NICK_LEN];
-    char receiver_nick[NICK_LEN];
-    char filename[256];
-    struct FileTransfer *next;
-} FileTransfer;
-
-// Variables globales
-Client *clients = NULL;
-Channel *channels = NULL;
-FileTransfer *pending_transfers = NULL;
-
-// Déclarations des fonctions (prototypes)
-void send_response(int fd, const char *nick_sender, enum msg_type type, const char *infos, const char *payload);
-void handle_nickname_new(int fd, struct message *msg);
-void handle_who(int fd);
-void handle_whois(int fd, struct message *msg);
-void handle_broadcast_send(int fd, const char *payload);
-void handle_unicast_send(int fd, struct message *msg, const char *payload);
-void handle_channel_message(int fd, struct message *msg, const char *payload);
-
-// Nouvelles déclarations pour le jalon 4
-void handle_file_request(int fd, struct message *msg, const char *payload);
-void handle_file_accept(int fd, struct message *msg, const char *payload);
-void handle_file_reject(int fd, struct message *msg);
-
-
-
-// Implémentation des fonctions
-void send_response(int fd, const char *nick_sender, enum msg_type type, 
-                  const char *infos, const char *payload) {
-    struct message msg;
-    memset(&msg, 0, sizeof(struct message));
-    
-    msg.type = type;
-    strncpy(msg.nick_sender, nick_sender, NICK_LEN - 1);
-    if (infos) {
-        strncpy(msg.infos, infos, INFOS_LEN - 1);
-    }
-    msg.pld_len = payload ? strlen(payload) : 0;
-
-    // Envoyer la structure message
-    if (send(fd, &msg, sizeof(msg), 0) < 0) {
-        perror("send message structure");
-        return;
-    }
-
-    // Envoyer le payload si présent
-    if (payload && msg.pld_len > 0) {
-        if (send(fd, payload, msg.pld_len, 0) < 0) {
-            perror("send payload");
-        }
-    }
-}
-
-int is_nickname_valid(const char *nickname) {
-    if (strlen(nickname) == 0 || strlen(nickname) >= NICK_LEN)
-        return 0;
-    
-    for (int i = 0; nickname[i]; i++) {
-        char c = nickname[i];
-        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
-              (c >= '0' && c <= '9')))
-            return 0;
-    }
-    return 1;
-}
-
-void add_client(int fd, struct sockaddr_in addr) {
-    Client *new_client = malloc(sizeof(Client));
-    if (!new_client) {
-        perror("malloc");
-        return;
-    }
-    
-    new_client->fd = fd;
-    new_client->addr = addr;
-    new_client->nickname[0] = '\0';
-    new_client->connection_time = time(NULL);
-    new_client->current_channel[0] = '\0';
-    new_client->next = clients;
-    clients = new_client;
-
-    send_response(fd, "Server", ECHO_SEND, "", "Please login with /nick <your pseudo>");
-    printf("New client connected: %s:%d\n", 
-           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-}
-
-void remove_client(int fd) {
-    Client **pp = &clients;
-    while (*pp && (*pp)->fd != fd) {
-        pp = &(*pp)->next;
-    }
-    if (*pp) {
-        Client *tmp = *pp;
-        *pp = (*pp)->next;
-        printf("Client removed: %s:%d\n", 
-               inet_ntoa(tmp->addr.sin_addr), ntohs(tmp->addr.sin_port));
-        free(tmp);
-    }
-}
-
-void broadcast_to_channel(const char *channel_name, const char *sender, 
-                         const char *message, enum msg_type type) {
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->current_channel[0] && 
-            strcmp(curr->current_channel, channel_name) == 0) {
-            send_response(curr->fd, sender, type, channel_name, message);
-        }
-    }
-}
-
-Channel* find_channel(const char *name) {
-    Channel *curr = channels;
-    while (curr) {
-        if (strcmp(curr->name, name) == 0)
-            return curr;
-        curr = curr->next;
-    }
-    return NULL;
-}
-
-void leave_current_channel(Client *client) {
-    if (client->current_channel[0] != '\0') {
-        Channel *channel = find_channel(client->current_channel);
-        if (channel) {
-            channel->num_users--;
-            
-            char notice[256];
-            snprintf(notice, sizeof(notice), "%s has quit %s", 
-                    client->nickname, channel->name);
-            broadcast_to_channel(channel->name, "Server", notice, MULTICAST_QUIT);
-            
-            if (channel->num_users == 0) {
-                send_response(client->fd, "Server", MULTICAST_QUIT, 
-                            channel->name, "You were the last user in this channel");
-                
-                Channel **pp = &channels;
-                while (*pp && strcmp((*pp)->name, channel->name) != 0) {
-                    pp = &(*pp)->next;
-                }
-                if (*pp) {
-                    Channel *tmp = *pp;
-                    *pp = (*pp)->next;
-                    free(tmp);
-                }
-            }
-            client->current_channel[0] = '\0';
-        }
-    }
-}
-
-void handle_nickname_new(int fd, struct message *msg) {
-    if (!is_nickname_valid(msg->infos)) {
-        send_response(fd, "Server", NICKNAME_NEW, "", "Invalid nickname format");
-        return;
-    }
-
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (strcmp(curr->nickname, msg->infos) == 0 && curr->fd != fd) {
-            send_response(fd, "Server", NICKNAME_NEW, "", "Nickname already taken");
-            return;
-        }
-    }
-
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            strncpy(curr->nickname, msg->infos, NICK_LEN - 1);
-            curr->nickname[NICK_LEN - 1] = '\0';
-            
-            // Construction sécurisée du message de bienvenue
-            char response[INFOS_LEN];
-            const char *prefix = "Welcome on the chat ";
-            size_t prefix_len = strlen(prefix);
-            size_t max_nick_len = INFOS_LEN - prefix_len - 1;
-            
-            strncpy(response, prefix, INFOS_LEN - 1);
-            strncat(response, msg->infos, max_nick_len);
-            response[INFOS_LEN - 1] = '\0';
-
-            send_response(fd, "Server", NICKNAME_NEW, "", response);
-            printf("Client %d changed nickname to %s\n", fd, msg->infos);
-            return;
-        }
-    }
-}
-
-void handle_who(int fd) {
-    char user_list[PAYLOAD_SIZE] = "Online users are:\n";
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->nickname[0]) {
-            char user[NICK_LEN + 4];
-            snprintf(user, sizeof(user), "- %s\n", curr->nickname);
-            strcat(user_list, user);
-        }
-    }
-    send_response(fd, "Server", NICKNAME_LIST, "", user_list);
-}
-
-void handle_whois(int fd, struct message *msg) {
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (strcmp(curr->nickname, msg->infos) == 0) {
-            char time_str[30];
-            strftime(time_str, sizeof(time_str), "%Y/%m/%d@%H:%M", 
-                    localtime(&curr->connection_time));
-            
-            char info[PAYLOAD_SIZE];
-            snprintf(info, PAYLOAD_SIZE, "%s connected since %s with IP address %s and port number %d",
-                    curr->nickname, time_str, 
-                    inet_ntoa(curr->addr.sin_addr), 
-                    ntohs(curr->addr.sin_port));
-            
-            send_response(fd, "Server", NICKNAME_INFOS, "", info);
-            return;
-        }
-    }
-    send_response(fd, "Server", NICKNAME_INFOS, "", "User not found");
-}
-
-void handle_broadcast_send(int fd, const char *payload) {
-    Client *sender = NULL;
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            sender = curr;
-            break;
-        }
-    }
-
-    if (!sender || !sender->nickname[0]) {
-        send_response(fd, "Server", BROADCAST_SEND, "", "You must set a nickname first");
-        return;
-    }
-
-    // Envoyer à tous les autres clients
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd != fd && curr->nickname[0]) {
-            send_response(curr->fd, sender->nickname, BROADCAST_SEND, "", payload);
-        }
-    }
-}
-
-void handle_unicast_send(int fd, struct message *msg, const char *payload) {
-    Client *sender = NULL;
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            sender = curr;
-            break;
-        }
-    }
-
-    if (!sender || !sender->nickname[0]) {
-        send_response(fd, "Server", UNICAST_SEND, "", "You must set a nickname first");
-        return;
-    }
-
-    // Chercher le destinataire et envoyer le message
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (strcmp(curr->nickname, msg->infos) == 0) {
-            send_response(curr->fd, sender->nickname, UNICAST_SEND, "", payload);
-            return;
-        }
-    }
-
-    // Construction sécurisée du message d'erreur
-    char error[INFOS_LEN];
-    const char *prefix = "User ";
-    const char *suffix = " does not exist";
-    size_t prefix_len = strlen(prefix);
-    size_t suffix_len = strlen(suffix);
-    size_t max_nick_len = INFOS_LEN - prefix_len - suffix_len - 1;
-
-    strncpy(error, prefix, INFOS_LEN - 1);
-    strncat(error, msg->infos, max_nick_len);
-    strncat(error, suffix, INFOS_LEN - strlen(error) - 1);
-    error[INFOS_LEN - 1] = '\0';
-
-    send_response(fd, "Server", UNICAST_SEND, "", error);
-}
-
-void handle_create_channel(int fd, struct message *msg) {
-    Client *client = NULL;
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            client = curr;
-            break;
-        }
-    }
-
-    if (!client || !client->nickname[0]) {
-        send_response(fd, "Server", MULTICAST_CREATE, "", "You must set a nickname first");
-        return;
-    }
-
-    if (!is_nickname_valid(msg->infos)) {
-        send_response(fd, "Server", MULTICAST_CREATE, "", "Invalid channel name");
-        return;
-    }
-
-    if (find_channel(msg->infos)) {
-        send_response(fd, "Server", MULTICAST_CREATE, "", "Channel already exists");
-        return;
-    }
-
-    // Créer le nouveau salon
-    Channel *new_channel = malloc(sizeof(Channel));
-    if (!new_channel) {
-        perror("malloc");
-        return;
-    }
-
-    strncpy(new_channel->name, msg->infos, CHANNEL_NAME_LEN - 1);
-    new_channel->name[CHANNEL_NAME_LEN - 1] = '\0';
-    new_channel->num_users = 0;
-    new_channel->next = channels;
-    channels = new_channel;
-
-    // Faire rejoindre le salon au créateur
-    leave_current_channel(client);
-    strncpy(client->current_channel, msg->infos, CHANNEL_NAME_LEN - 1);
-    client->current_channel[CHANNEL_NAME_LEN - 1] = '\0';
-    new_channel->num_users++;
-
-    send_response(fd, "Server", MULTICAST_CREATE, "", "Channel created successfully");
-    char join_msg[PAYLOAD_SIZE];
-    snprintf(join_msg, PAYLOAD_SIZE, "You have joined %s", msg->infos);
-    send_response(fd, "Server", MULTICAST_JOIN, msg->infos, join_msg);
-}
-
-void handle_channel_list(int fd) {
-    char list[PAYLOAD_SIZE] = "Available channels:\n";
-    for (Channel *curr = channels; curr != NULL; curr = curr->next) {
-        char channel_info[128];
-        snprintf(channel_info, sizeof(channel_info), "- %s (%d users)\n", 
-                curr->name, curr->num_users);
-        strcat(list, channel_info);
-    }
-    send_response(fd, "Server", MULTICAST_LIST, "", list);
-}
-
-void handle_join_channel(int fd, struct message *msg) {
-    Client *client = NULL;
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            client = curr;
-            break;
-        }
-    }
-
-    if (!client || !client->nickname[0]) {
-        send_response(fd, "Server", MULTICAST_JOIN, "", "You must set a nickname first");
-        return;
-    }
-
-    Channel *channel = find_channel(msg->infos);
-    if (!channel) {
-        send_response(fd, "Server", MULTICAST_JOIN, "", "Channel does not exist");
-        return;
-    }
-
-    // Quitter le salon actuel si nécessaire
-    leave_current_channel(client);
-
-    // Rejoindre le nouveau salon
-    strncpy(client->current_channel, msg->infos, CHANNEL_NAME_LEN - 1);
-    client->current_channel[CHANNEL_NAME_LEN - 1] = '\0';
-    channel->num_users++;
-
-    // Notifier tout le monde
-    char notice[PAYLOAD_SIZE];
-    snprintf(notice, sizeof(notice), "%s has joined the channel", client->nickname);
-    broadcast_to_channel(channel->name, "Server", notice, MULTICAST_JOIN);
-
-    char join_msg[PAYLOAD_SIZE];
-    snprintf(join_msg, PAYLOAD_SIZE, "You have joined %s", msg->infos);
-    send_response(fd, "Server", MULTICAST_JOIN, msg->infos, join_msg);
-}
-
-void handle_channel_message(int fd, struct message *msg, const char *payload) {
-    Client *client = NULL;
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            client = curr;
-            break;
-        }
-    }
-
-    if (!client || !client->nickname[0]) {
-        send_response(fd, "Server", MULTICAST_SEND, "", "You must set a nickname first");
-        return;
-    }
-
-    if (!client->current_channel[0]) {
-        send_response(fd, "Server", MULTICAST_SEND, "", "You must join a channel first");
-        return;
-    }
-
-    // Utiliser msg->infos pour vérifier si un canal spécifique est demandé
-    if (msg && msg->infos[0] != '\0') {
-        Channel *requested_channel = find_channel(msg->infos);
-        if (!requested_channel || strcmp(msg->infos, client->current_channel) != 0) {
-            send_response(fd, "Server", MULTICAST_SEND, "", "Invalid channel or not your current channel");
-            return;
-        }
-    }
-
-    // Vérifier si le canal existe toujours
-    if (!find_channel(client->current_channel)) {
-        send_response(fd, "Server", MULTICAST_SEND, "", "Your channel no longer exists");
-        client->current_channel[0] = '\0';
-        return;
-    }
-
-    broadcast_to_channel(client->current_channel, client->nickname, payload, MULTICAST_SEND);
-}
-void handle_quit_channel(int fd, struct message *msg) {
-    Client *client = NULL;
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            client = curr;
-            break;
-        }
-    }
-
-    if (!client || !client->nickname[0]) {
-        send_response(fd, "Server", MULTICAST_QUIT, "", "You must set a nickname first");
-        return;
-    }
-
-    if (strcmp(client->current_channel, msg->infos) != 0) {
-        send_response(fd, "Server", MULTICAST_QUIT, "", "You are not in this channel");
-        return;
-    }
-
-    leave_current_channel(client);
-}
-
-void handle_file_request(int fd, struct message *msg, const char *payload) {
-    Client *sender = NULL;
-    Client *receiver = NULL;
-
-    // Trouver l'émetteur et le récepteur
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            sender = curr;
-        }
-        if (strcmp(curr->nickname, msg->infos) == 0) {
-            receiver = curr;
-        }
-    }
-
-    if (!sender || !sender->nickname[0]) {
-        send_response(fd, "Server", FILE_REQUEST, "", "You must set a nickname first");
-        return;
-    }
-
-    if (!receiver) {
-        send_response(fd, "Server", FILE_REQUEST, "", "Recipient not found");
-        return;
-    }
-
-    printf("File request from %s to %s: %s\n", sender->nickname, receiver->nickname, payload);
-
-    // Transmettre la demande au récepteur
-    char request_msg[512];
-    snprintf(request_msg, sizeof(request_msg), "%s", payload);
-    send_response(receiver->fd, sender->nickname, FILE_REQUEST, "", request_msg);
-}
-
-void handle_file_accept(int fd, struct message *msg, const char *payload) {
-    Client *receiver = NULL;
-    Client *sender = NULL;
-
-    // Trouver le récepteur (celui qui accepte) et l'émetteur
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            receiver = curr;
-        }
-        if (strcmp(curr->nickname, msg->infos) == 0) {
-            sender = curr;
-        }
-    }
-
-    if (!receiver || !sender) {
-        printf("Sender or receiver not found in file accept\n");
-        return;
-    }
-
-    printf("File accept from %s to %s with address %s\n", 
-           receiver->nickname, sender->nickname, payload);
-
-    // Envoyer les informations de connexion à l'émetteur
-    send_response(sender->fd, receiver->nickname, FILE_ACCEPT, receiver->nickname, payload);
-}
-
-void handle_file_reject(int fd, struct message *msg) {
-    Client *receiver = NULL;
-    Client *sender = NULL;
-
-    // Trouver le récepteur (celui qui refuse) et l'émetteur
-    for (Client *curr = clients; curr != NULL; curr = curr->next) {
-        if (curr->fd == fd) {
-            receiver = curr;
-        }
-        if (strcmp(curr->nickname, msg->infos) == 0) {
-            sender = curr;
-        }
-    }
-
-    if (!receiver || !sender) {
-        printf("Sender or receiver not found in file reject\n");
-        return;
-    }
-
-    printf("File reject from %s to %s\n", receiver->nickname, sender->nickname);
-
-    // Notifier l'émetteur
-    send_response(sender->fd, receiver->nickname, FILE_REJECT, receiver->nickname, 
-                 "File transfer was rejected");
-}
-
-void handle_client_message(int fd, struct message *msg) {
-    char payload[PAYLOAD_SIZE];
-    memset(payload, 0, PAYLOAD_SIZE);
-    
-    if (msg->pld_len > 0) {
-        if (recv(fd, payload, msg->pld_len, 0) < 0) {
-            perror("recv payload");
-            return;
-        }
-        payload[msg->pld_len] = '\0';
-    }
-
-    switch (msg->type) {
-        case NICKNAME_NEW:
-            handle_nickname_new(fd, msg);
-            break;
-        case NICKNAME_LIST:
-            handle_who(fd);
-            break;
-        case NICKNAME_INFOS:
-            handle_whois(fd, msg);
-            break;
-        case BROADCAST_SEND:
-            handle_broadcast_send(fd, payload);
-            break;
-        case UNICAST_SEND:
-            handle_unicast_send(fd, msg, payload);
-            break;
-        case MULTICAST_CREATE:
-            handle_create_channel(fd, msg);
-            break;
-        case MULTICAST_LIST:
-            handle_channel_list(fd);
-            break;
-        case MULTICAST_JOIN:
-            handle_join_channel(fd, msg);
-            break;
-        case MULTICAST_SEND:
-            handle_channel_message(fd, msg, payload);
-            break;
-        case MULTICAST_QUIT:
-            handle_quit_channel(fd, msg);
-            break;
-        case ECHO_SEND:
-            send_response(fd, "Server", ECHO_SEND, "", payload);
-            break;
-        case FILE_REQUEST:
-            printf("Received file request\n");
-            handle_file_request(fd, msg, payload);
-            break;
-
-        case FILE_ACCEPT:
-            printf("Received file accept\n");
-            handle_file_accept(fd, msg, payload);
-            break;
-
-        case FILE_REJECT:
-            printf("Received file reject\n");
-            handle_file_reject(fd, msg);
-            break;
-
-        case FILE_ACK:
-            // Transmettre l'accusé de réception à l'émetteur
-            for (Client *curr = clients; curr != NULL; curr = curr->next) {
-                if (strcmp(curr->nickname, msg->infos) == 0) {
-                    send_response(curr->fd, msg->nick_sender, FILE_ACK, msg->infos, payload);
-                    break;
-                }
-            }
-            break;
-        default:
-            fprintf(stderr, "Unknown message type\n");
-    }
-}
-
-
-int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    int sfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sfd == -1) {
-        perror("socket");
-        exit(EXIT_FAILURE);
-    }
-
-    int opt = 1;
-    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        perror("setsockopt");
-        exit(EXIT_FAILURE);
-    }
-
-    struct sockaddr_in addr;
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(atoi(argv[1]));
-    addr.sin_addr.s_addr = INADDR_ANY;
-
-    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-        perror("bind");
-        
-        exit(EXIT_FAILURE);
-    }
-
-    if (listen(sfd, SOMAXCONN) < 0) {
-        perror("listen");
-        exit(EXIT_FAILURE);
-    }
-
-    printf("Server listening on port %s\n", argv[1]);
-
-    struct pollfd fds[MAX_CLIENTS + 1];
-    int nfds = 1;
-    fds[0].fd = sfd;
-    fds[0].events = POLLIN;
-
-    while (1) {
-        int ret = poll(fds, nfds, -1);
-        if (ret < 0) {
-            perror("poll");
-            break;
-        }
-
-        for (int i = 0; i < nfds; i++) {
-            if (fds[i].revents & POLLIN) {
-                if (fds[i].fd == sfd) {
-                    struct sockaddr_in client_addr;
-                    socklen_t client_len = sizeof(client_addr);
-                    int client_fd = accept(sfd, (struct sockaddr *)&client_addr, &client_len);
-                    
-                    if (client_fd < 0) {
-                        perror("accept");
-                        continue;
-                    }
-
-                    if (nfds < MAX_CLIENTS + 1) {
-                        add_client(client_fd, client_addr);
-                        fds[nfds].fd = client_fd;
-                        fds[nfds].events = POLLIN;
-                        nfds++;
-                    } else {
-                        send_response(client_fd, "Server", ECHO_SEND, "", "Server is full");
-                        close(client_fd);
-                    }
-                } else {
-                    struct message msg;
-                    int received = recv(fds[i].fd, &msg, sizeof(struct message), 0);
-                    
-                    if (received <= 0) {
-                        close(fds[i].fd);
-                        remove_client(fds[i].fd);
-                        for (int j = i; j < nfds - 1; j++) {
-                            fds[j] = fds[j + 1];
-                        }
-                        nfds--;
-                        i--;
-                    } else {
-                        handle_client_message(fds[i].fd, &msg);
-                    }
-                }
-            }
-        }
-    }
-
-    close(sfd);
-    return 0;
-}
\ No newline at end of file
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <signal.h>
+#include <stdint.h>
+#include <time.h>
+#include "msg_struct.h"
+
+#define MAX_EVENTS 64
+#define TARGET_CONNECTIONS 100000
+#define MAX_CHANNELS 100
+#define CHANNEL_NAME_LEN 50
+#define PAYLOAD_SIZE 1024
+#define HEADER_SIZE sizeof(struct message)
+#define READ_CHUNK 65536
+#define DEFAULT_HIGH_WATERMARK (256 * 1024)
+#define DEFAULT_LOW_WATERMARK (64 * 1024)
+#define OUTQ_HARD_FACTOR 8
+#define DEFAULT_MAX_MESSAGE (1024 * 1024)
+#define RBUF_SIZE (HEADER_SIZE + PAYLOAD_SIZE)
+#define FLUSH_IOV_MAX 64
+#define OUTQ_INITIAL_CAP 8
+#define COALESCE_MAX_BYTES (16 * 1024)
+#define STRMAP_INITIAL_CAP 64
+#define CACHE_LINE 64
+#define POOL_SLAB_SIZE 65536
+#define SERVER_NICK_STAMP 1
+#define RELAY_PIPE_SIZE (1024 * 1024)
+#define RELAY_TAG ((uintptr_t)1)
+#define MAX_PENDING_RELAY_ENDS 1024
+
+// Étape courante de la réassemblage d'une trame reçue
+enum read_state {
+    READ_HEADER,
+    READ_PAYLOAD
+};
+
+// Trame sérialisée une seule fois (en-tête + payload) et partagée par
+// référence entre les files de sortie de tous ses destinataires ; libérée
+// quand le dernier l'a envoyée
+typedef struct Frame {
+    int refcnt;
+    size_t len;
+    uint32_t nick_stamp;    // pseudo de l'émetteur à internaliser, 0 sinon
+    size_t nick_end;        // fin du champ pseudo (trames v2)
+    char data[];
+} Frame;
+
+// Message diffusé à des clients de versions différentes : il est sérialisé
+// au plus une fois par version, à la première demande
+typedef struct FrameSet {
+    const char *nick_sender;
+    enum msg_type type;
+    const char *infos;
+    const char *payload;
+    size_t payload_len;
+    Frame *frames[PROTO_V2 + 1];
+} FrameSet;
+
+// Entrée de la file de sortie d'un client : un préfixe propre au client
+// (pseudo exprimé dans son dictionnaire) suivi de la trame partagée à
+// partir de l'octet start ; off compte les octets déjà envoyés
+typedef struct OutChunk {
+    Frame *frame;
+    size_t start;
+    size_t off;
+    unsigned char prefix_len;
+    unsigned char prefix[2];
+} OutChunk;
+
+// Structures existantes
+//
+// Coût mémoire d'une connexion inactive (mesuré par make loadtest) : ~350
+// octets de RSS côté serveur (le Client, dans une case de 320 octets de son
+// pool, et son entrée dans client_table ; sa file de sortie vide est rendue
+// au pool), plus ~5 Ko de mémoire noyau (socket TCP, fichier, entrée epoll,
+// tampons). 100 000 connexions coûtent donc ~35 Mo au processus et ~500 Mo
+// au noyau.
+typedef struct Client {
+    int fd;
+    struct sockaddr_in addr;
+    char nickname[NICK_LEN];
+    time_t connection_time;
+    int channel_id;     // identifiant du salon courant, -1 si aucun
+    int channel_slot;   // position dans le tableau des membres du salon
+    int proto_in;       // version du protocole des trames reçues
+    int proto_out;      // version du protocole des trames envoyées
+    uint32_t nick_stamp;    // change à chaque changement de pseudo
+    uint32_t *nick_dict;    // estampilles des pseudos connus du client (v2)
+    size_t rlen;        // octets de la trame courante déjà dans rbuf
+    size_t stream_len;  // octets déjà reçus du message en plusieurs morceaux
+    int stream_discard; // message trop long : morceaux ignorés jusqu'au dernier
+    int stream_type;    // type du message en plusieurs morceaux ouvert, -1 si aucun
+    int stream_dest;    // son destinataire (UNICAST_SEND) : descripteur
+    uint32_t stream_dest_stamp; // et estampille du pseudo
+    int batch_frames;   // trames du lot en attente d'envoi, 0 si aucun lot
+    enum read_state rstate;
+    char *rbuf;         // trame partielle, allouée seulement si nécessaire
+    OutChunk *outq;     // file circulaire des données à envoyer
+    int outq_head;
+    int outq_count;
+    int outq_cap;
+    uint32_t batch_deadline;    // date d'envoi au plus tard du lot (ms)
+    size_t out_bytes;   // octets en attente dans la file
+    int read_paused;    // lecture suspendue (file au-dessus du seuil haut)
+    int closing;        // fermeture programmée en fin d'itération
+    struct Client *close_next;
+    // Liste des clients ayant un lot en attente ; dirty_pprev désigne le
+    // pointeur qui mène au client (tête de liste ou dirty_next du
+    // précédent), NULL hors liste
+    struct Client **dirty_pprev;
+    struct Client *dirty_next;
+    struct Client *prev;
+    struct Client *next;
+} Client;
+
+// Le nombre d'utilisateurs d'un salon est la taille de son ensemble de
+// membres ; chaque Client connaît sa position dans le tableau, ce qui rend
+// l'ajout et le retrait en O(1)
+typedef struct Channel {
+    int id;             // petit entier, indice dans channel_table
+    char name[CHANNEL_NAME_LEN];
+    struct Client **members;
+    int num_users;
+    int members_cap;
+} Channel;
+
+// Pool d'objets de taille fixe : les objets sont découpés dans des blocs
+// (slabs) de POOL_SLAB_SIZE octets alignés sur une ligne de cache, et les
+// cases libérées sont chaînées dans une liste libre. Allouer ou libérer ne
+// fait appel au tas que lorsqu'il faut un nouveau bloc ; les blocs ne sont
+// rendus au système qu'en une fois, par pool_destroy().
+typedef struct Pool {
+    const char *name;
+    size_t obj_size;        // taille d'une case, multiple de CACHE_LINE
+    size_t objs_per_slab;
+    void *free_list;        // cases libres, chaînées par leur premier mot
+    void *slabs;            // blocs alloués, chaînés par leur en-tête
+    unsigned long num_slabs;
+    unsigned long allocs;
+    unsigned long in_use;
+    unsigned long peak_in_use;
+} Pool;
+
+// Table de hachage à adressage ouvert (sondage linéaire) indexée par
+// chaîne. La clé n'est pas copiée : elle doit rester valide et inchangée
+// tant que l'entrée est présente.
+typedef struct StrMapEntry {
+    const char *key;    // NULL si la case est libre
+    uint32_t hash;
+    void *value;
+} StrMapEntry;
+
+typedef struct StrMap {
+    StrMapEntry *entries;
+    size_t cap;         // toujours une puissance de 2
+    size_t count;
+} StrMap;
+
+// Nouvelle structure pour le jalon 4
+typedef struct FileTransfer {
+    char sender_nick[NICK_LEN];
+    char receiver_nick[NICK_LEN];
+    char filename[256];
+    unsigned int id;    // numéro donné par l'émetteur, 0 s'il n'en donne pas
+    struct FileTransfer *next;
+} FileTransfer;
+
+// Connexion de données ouverte vers le port de relais. Tant que son jeton
+// n'est pas arrivé elle n'est rattachée à aucun relais et reste dans la
+// liste pending_ends.
+typedef struct RelayEnd {
+    int fd;             // -1 une fois fermée, en attente de libération
+    struct Relay *relay;
+    uint32_t deadline;  // arrivée au plus tard du jeton (ms)
+    struct RelayEnd *prev;
+    struct RelayEnd *next;
+} RelayEnd;
+
+// Transfert relayé : les octets du fichier passent de la connexion de
+// l'émetteur à celle du destinataire par splice(), à travers un tube, sans
+// jamais être copiés dans l'espace utilisateur
+typedef struct Relay {
+    char token[RELAY_TOKEN_LEN + 1];
+    char sender_nick[NICK_LEN];
+    char receiver_nick[NICK_LEN];
+    char filename[256];
+    RelayEnd *src;      // connexion de l'émetteur
+    RelayEnd *dst;      // connexion du destinataire
+    int pipe[2];
+    size_t pipe_cap;
+    size_t in_pipe;     // octets lus de src pas encore écrits sur dst
+    size_t bytes;       // octets remis au destinataire
+    int src_eof;
+    int closing;        // destruction programmée en fin d'itération
+    uint32_t deadline;  // arrivée au plus tard des deux connexions (ms)
+    struct timespec start;
+    struct Relay *close_next;
+    struct Relay *prev;
+    struct Relay *next;
+} Relay;
+
+// Variables globales
+Client *clients = NULL;
+FileTransfer *pending_transfers = NULL;
+int epoll_fd = -1;
+int num_clients = 0;
+int spare_fd = -1;
+Client *closing_clients = NULL;
+Client *dirty_clients = NULL;           // clients ayant un lot à envoyer
+StrMap nick_index = { NULL, 0, 0 };     // pseudo -> Client
+Client **client_table = NULL;           // fd -> Client, accès direct
+int client_table_cap = 0;
+
+// Relais de fichiers, actif si un port de relais est configuré (-R). Les
+// connexions de données sont enregistrées dans l'epoll avec un pointeur
+// marqué par RELAY_TAG (les Client sont alignés, leur bit de poids faible
+// est nul) ; la socket d'écoute du relais porte le marqueur seul.
+int relay_port = 0;
+Relay *relays = NULL;
+StrMap relay_index = { NULL, 0, 0 };    // jeton -> Relay
+Relay *closing_relays = NULL;
+
+// Connexions de données sans jeton, par ordre d'arrivée et donc
+// d'échéance ; leur nombre est borné par MAX_PENDING_RELAY_ENDS
+RelayEnd *pending_ends = NULL;
+RelayEnd *pending_ends_tail = NULL;
+int num_pending_ends = 0;
+RelayEnd *dead_ends = NULL;             // fermées, libérées en fin d'itération
+
+// Registre des salons : nom -> Channel par hachage, identifiant -> Channel
+// par accès direct. Les identifiants libérés sont réutilisés.
+StrMap channel_index = { NULL, 0, 0 };
+Channel **channel_table = NULL;
+int channel_table_len = 0;
+int channel_table_cap = 0;
+int *free_channel_ids = NULL;
+int num_free_channel_ids = 0;
+
+// Chaque pseudo attribué reçoit une estampille jamais réutilisée (sauf
+// après 2^32 changements) : une entrée de dictionnaire qui porte une
+// ancienne estampille est ainsi invalidée sans avoir à la rechercher
+uint32_t next_nick_stamp = SERVER_NICK_STAMP + 1;
+
+// Pools des enregistrements alloués à chaque connexion, salon ou transfert,
+// et des tampons d'une connexion (trame partielle, dictionnaire de pseudos,
+// file de sortie à sa capacité initiale) : une rafale de connexions et de
+// déconnexions ne fait appel au tas que pour de nouveaux blocs
+#define POOL_INITIALIZER_SIZE(name, size) \
+    { name, ((size) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE, 0, NULL, NULL, 0, 0, 0, 0 }
+#define POOL_INITIALIZER(name, type) POOL_INITIALIZER_SIZE(name, sizeof(type))
+Pool client_pool = POOL_INITIALIZER("clients", Client);
+Pool channel_pool = POOL_INITIALIZER("channels", Channel);
+Pool transfer_pool = POOL_INITIALIZER("transfers", FileTransfer);
+Pool rbuf_pool = POOL_INITIALIZER_SIZE("read buffers", RBUF_SIZE);
+Pool dict_pool = POOL_INITIALIZER_SIZE("nick dictionaries", NICK_DICT_SIZE * sizeof(uint32_t));
+Pool outq_pool = POOL_INITIALIZER_SIZE("output queues", OUTQ_INITIAL_CAP * sizeof(OutChunk));
+
+// Trame d'accueil, identique pour tous : sérialisée une fois, elle garde
+// une référence permanente
+Frame *greeting_frame;
+
+// Seuils de la file de sortie : au-dessus du seuil haut on cesse de lire
+// les requêtes du client, on reprend quand la file redescend sous le seuil
+// bas. Au-delà de conn_mem_cap octets retenus pour lui (file de sortie et
+// trame partielle), par défaut OUTQ_HARD_FACTOR fois le seuil haut, le
+// client est considéré comme trop lent et déconnecté.
+size_t high_watermark = DEFAULT_HIGH_WATERMARK;
+size_t low_watermark = DEFAULT_LOW_WATERMARK;
+size_t conn_mem_cap = 0;
+
+// Taille maximale d'un message, tous morceaux confondus ; au-delà il est
+// tronqué
+size_t max_message_size = DEFAULT_MAX_MESSAGE;
+
+// Regroupement des envois : les trames destinées à un client pendant une
+// itération de la boucle sont mises en file puis envoyées ensemble, en un
+// seul sendmsg(), à la fin de l'itération. Avec un délai non nul, un lot
+// peut attendre jusqu'à coalesce_delay ms les trames des itérations
+// suivantes ; il part plus tôt dès qu'il atteint COALESCE_MAX_BYTES.
+unsigned int coalesce_delay = 0;
+uint32_t loop_time = 0;     // horloge monotone (ms) au réveil de la boucle
+
+// Compteurs affichés sur SIGUSR1
+struct server_stats {
+    size_t queued_bytes;        // total en attente dans toutes les files
+    size_t peak_queued_bytes;
+    unsigned long frames_live;  // trames partagées encore référencées
+    size_t frame_bytes_live;    // mémoire réellement occupée par ces trames
+    unsigned long paused_reads;
+    unsigned long slow_drops;
+    unsigned long truncated;    // messages dépassant max_message_size
+    unsigned long flushes;      // lots envoyés
+    unsigned long flushed_frames;
+    unsigned long max_batch;    // plus grand nombre de trames d'un lot
+    unsigned long nick_refs;    // pseudos remplacés par une référence
+    unsigned long nick_defs;    // entrées de dictionnaire (re)définies
+    size_t nick_bytes_saved;
+    unsigned long relays_done;  // transferts relayés jusqu'au bout
+    unsigned long relays_failed;
+    unsigned long relay_ends_dropped;   // connexions sans jeton valide à temps
+    unsigned long long relayed_bytes;
+} stats;
+
+volatile sig_atomic_t stats_requested = 0;
+
+// Déclarations des fonctions (prototypes)
+void send_response(int fd, const char *nick_sender, enum msg_type type, const char *infos, const char *text);
+void handle_client_readable(Client *client);
+void leave_current_channel(Client *client);
+void close_chunk_stream(Client *client);
+void handle_nickname_new(int fd, struct message *msg);
+void handle_who(int fd);
+void handle_whois(int fd, struct message *msg);
+void handle_broadcast_send(int fd, struct message *msg, const char *payload, size_t len);
+void handle_unicast_send(int fd, struct message *msg, const char *payload, size_t len);
+void handle_channel_message(int fd, struct message *msg, const char *payload, size_t len);
+
+// Nouvelles déclarations pour le jalon 4
+void handle_file_request(int fd, struct message *msg, const char *payload, size_t len);
+void handle_file_accept(int fd, struct message *msg, const char *payload, size_t len);
+void handle_file_reject(int fd, struct message *msg, const char *payload, size_t len);
+void handle_proto_negotiate(int fd, struct message *msg);
+void drop_client_transfers(Client *client, int notify_client);
+void drop_client_relays(Client *client);
+
+
+
+// Implémentation des fonctions
+uint32_t hash_string(const char *str) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (; *str; str++) {
+        h ^= (unsigned char)*str;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Retourne la case de key, ou la case libre où l'insérer
+StrMapEntry *strmap_slot(StrMap *map, const char *key, uint32_t hash) {
+    size_t mask = map->cap - 1;
+    for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+        StrMapEntry *e = &map->entries[i];
+        if (!e->key || (e->hash == hash && strcmp(e->key, key) == 0))
+            return e;
+    }
+}
+
+void *strmap_get(StrMap *map, const char *key) {
+    if (map->count == 0)
+        return NULL;
+    StrMapEntry *e = strmap_slot(map, key, hash_string(key));
+    return e->key ? e->value : NULL;
+}
+
+int strmap_grow(StrMap *map) {
+    size_t new_cap = map->cap ? map->cap * 2 : STRMAP_INITIAL_CAP;
+    StrMapEntry *entries = calloc(new_cap, sizeof(StrMapEntry));
+    if (!entries) {
+        perror("calloc");
+        return -1;
+    }
+
+    StrMap grown = { entries, new_cap, map->count };
+    for (size_t i = 0; i < map->cap; i++) {
+        StrMapEntry *e = &map->entries[i];
+        if (e->key)
+            *strmap_slot(&grown, e->key, e->hash) = *e;
+    }
+    free(map->entries);
+    *map = grown;
+    return 0;
+}
+
+int strmap_put(StrMap *map, const char *key, void *value) {
+    // Facteur de charge maximal de 1/2 pour garder des sondages courts
+    if ((map->count + 1) * 2 > map->cap && strmap_grow(map) < 0)
+        return -1;
+
+    uint32_t hash = hash_string(key);
+    StrMapEntry *e = strmap_slot(map, key, hash);
+    if (!e->key)
+        map->count++;
+    e->key = key;
+    e->hash = hash;
+    e->value = value;
+    return 0;
+}
+
+// Suppression par décalage arrière : pas de marqueurs de suppression, les
+// chaînes de sondage restent compactes
+void strmap_remove(StrMap *map, const char *key) {
+    if (map->count == 0)
+        return;
+
+    size_t mask = map->cap - 1;
+    StrMapEntry *e = strmap_slot(map, key, hash_string(key));
+    if (!e->key)
+        return;
+
+    size_t hole = e - map->entries;
+    for (size_t i = (hole + 1) & mask; map->entries[i].key; i = (i + 1) & mask) {
+        size_t home = map->entries[i].hash & mask;
+        // L'entrée i peut combler le trou si sa case d'origine ne se trouve
+        // pas strictement entre le trou et elle
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->entries[hole] = map->entries[i];
+            hole = i;
+        }
+    }
+    map->entries[hole].key = NULL;
+    map->count--;
+}
+
+// Ajoute un bloc au pool et verse toutes ses cases dans la liste libre
+int pool_grow(Pool *pool) {
+    if (pool->objs_per_slab == 0)
+        pool->objs_per_slab = (POOL_SLAB_SIZE - CACHE_LINE) / pool->obj_size;
+
+    // La première ligne de cache du bloc sert d'en-tête pour le chaînage
+    char *slab = aligned_alloc(CACHE_LINE, POOL_SLAB_SIZE);
+    if (!slab) {
+        perror("aligned_alloc");
+        return -1;
+    }
+    *(void **)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->num_slabs++;
+
+    // Chaînage en ordre décroissant pour que les allocations suivantes
+    // parcourent le bloc dans l'ordre des adresses
+    for (size_t i = pool->objs_per_slab; i-- > 0; ) {
+        void *obj = slab + CACHE_LINE + i * pool->obj_size;
+        *(void **)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    return 0;
+}
+
+void *pool_alloc(Pool *pool) {
+    if (!pool->free_list && pool_grow(pool) < 0)
+        return NULL;
+
+    void *obj = pool->free_list;
+    pool->free_list = *(void **)obj;
+    pool->allocs++;
+    if (++pool->in_use > pool->peak_in_use)
+        pool->peak_in_use = pool->in_use;
+    return obj;
+}
+
+// La case revient en tête de la liste libre : encore chaude dans le cache,
+// c'est elle que la prochaine allocation réutilisera
+void pool_free(Pool *pool, void *obj) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->in_use--;
+}
+
+// Rend tous les blocs au système ; les objets encore alloués deviennent
+// invalides
+void pool_destroy(Pool *pool) {
+    while (pool->slabs) {
+        void *next = *(void **)pool->slabs;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+    pool->num_slabs = 0;
+    pool->in_use = 0;
+}
+
+Client *find_client_by_nick(const char *nickname) {
+    return strmap_get(&nick_index, nickname);
+}
+
+Client *find_client(int fd) {
+    if (fd < 0 || fd >= client_table_cap)
+        return NULL;
+    return client_table[fd];
+}
+
+// Agrandit la table fd -> Client pour qu'elle contienne fd ; le noyau
+// attribue les plus petits fd libres, la table reste donc dense
+int client_table_reserve(int fd) {
+    if (fd < client_table_cap)
+        return 0;
+
+    int new_cap = client_table_cap ? client_table_cap : 64;
+    while (new_cap <= fd)
+        new_cap *= 2;
+    Client **table = realloc(client_table, new_cap * sizeof(Client *));
+    if (!table) {
+        perror("realloc");
+        return -1;
+    }
+    memset(table + client_table_cap, 0, (new_cap - client_table_cap) * sizeof(Client *));
+    client_table = table;
+    client_table_cap = new_cap;
+    return 0;
+}
+
+// Programme la fermeture d'un client ; elle a lieu en fin d'itération de la
+// boucle d'événements pour que les pointeurs en cours d'utilisation restent
+// valides
+void schedule_close(Client *client) {
+    if (client->closing)
+        return;
+    client->closing = 1;
+    client->close_next = closing_clients;
+    closing_clients = client;
+}
+
+// Estampille du pseudo nick s'il est celui du serveur ou d'un client, 0 sinon
+uint32_t nick_stamp_of(const char *nick) {
+    if (strcmp(nick, "Server") == 0)
+        return SERVER_NICK_STAMP;
+    Client *owner = find_client_by_nick(nick);
+    return owner ? owner->nick_stamp : 0;
+}
+
+// Sérialise une trame dans la version proto du protocole ; le payload est
+// une suite quelconque de pld_len octets. L'appelant détient la première
+// référence.
+Frame *frame_create(int proto, const char *nick_sender, enum msg_type type,
+                    const char *infos, const char *payload, size_t pld_len) {
+    size_t hdr_len = HEADER_SIZE;
+    if (proto == PROTO_V2) {
+        hdr_len = v2_header_size(strnlen(nick_sender, NICK_LEN - 1),
+                                 infos ? strnlen(infos, INFOS_LEN - 1) : 0, pld_len);
+    }
+    Frame *frame = malloc(sizeof(Frame) + hdr_len + pld_len);
+    if (!frame) {
+        perror("malloc");
+        return NULL;
+    }
+
+    if (proto == PROTO_V2) {
+        v2_encode_header(frame->data, nick_sender, type, infos, pld_len);
+    } else {
+        struct message *msg = (struct message *)frame->data;
+        memset(msg, 0, sizeof(struct message));
+        msg->type = type & ~MSG_TYPE_MORE;
+        strncpy(msg->nick_sender, nick_sender, NICK_LEN - 1);
+        if (infos) {
+            strncpy(msg->infos, infos, INFOS_LEN - 1);
+        }
+        msg->pld_len = pld_len;
+    }
+    if (pld_len > 0)
+        memcpy(frame->data + hdr_len, payload, pld_len);
+
+    frame->refcnt = 1;
+    frame->len = hdr_len + pld_len;
+    frame->nick_stamp = 0;
+    frame->nick_end = 0;
+    if (proto == PROTO_V2) {
+        frame->nick_stamp = nick_stamp_of(nick_sender);
+        frame->nick_end = 1 + (unsigned char)frame->data[0];
+    }
+    stats.frames_live++;
+    stats.frame_bytes_live += frame->len;
+    return frame;
+}
+
+void frame_release(Frame *frame) {
+    if (--frame->refcnt == 0) {
+        stats.frames_live--;
+        stats.frame_bytes_live -= frame->len;
+        free(frame);
+    }
+}
+
+size_t chunk_len(const OutChunk *chunk) {
+    return chunk->prefix_len + chunk->frame->len - chunk->start;
+}
+
+// Décrit dans iov ce qui reste à envoyer du fragment ; retourne le nombre
+// d'entrées utilisées (2 au plus)
+int chunk_iov(OutChunk *chunk, struct iovec *iov) {
+    int iovcnt = 0;
+    size_t pos = chunk->start;
+    if (chunk->off < chunk->prefix_len) {
+        iov[iovcnt].iov_base = chunk->prefix + chunk->off;
+        iov[iovcnt].iov_len = chunk->prefix_len - chunk->off;
+        iovcnt++;
+    } else {
+        pos += chunk->off - chunk->prefix_len;
+    }
+    iov[iovcnt].iov_base = chunk->frame->data + pos;
+    iov[iovcnt].iov_len = chunk->frame->len - pos;
+    return iovcnt + 1;
+}
+
+// Rend la file circulaire à son pool si elle a sa capacité initiale, au tas
+// sinon
+void outq_free_ring(Client *client) {
+    if (client->outq_cap == OUTQ_INITIAL_CAP)
+        pool_free(&outq_pool, client->outq);
+    else
+        free(client->outq);
+}
+
+int outq_push(Client *client, const OutChunk *chunk) {
+    if (client->outq_count == client->outq_cap) {
+        // Seule une file qui déborde de sa capacité initiale passe par le tas
+        int new_cap = client->outq_cap ? client->outq_cap * 2 : OUTQ_INITIAL_CAP;
+        OutChunk *q;
+        if (new_cap == OUTQ_INITIAL_CAP) {
+            q = pool_alloc(&outq_pool);
+        } else {
+            q = malloc(new_cap * sizeof(OutChunk));
+            if (!q)
+                perror("malloc");
+        }
+        if (!q)
+            return -1;
+        for (int i = 0; i < client->outq_count; i++) {
+            q[i] = client->outq[(client->outq_head + i) % client->outq_cap];
+        }
+        if (client->outq)
+            outq_free_ring(client);
+        client->outq = q;
+        client->outq_head = 0;
+        client->outq_cap = new_cap;
+    }
+
+    int tail = (client->outq_head + client->outq_count) % client->outq_cap;
+    chunk->frame->refcnt++;
+    client->outq[tail] = *chunk;
+    client->outq_count++;
+
+    size_t len = chunk_len(chunk) - chunk->off;
+    client->out_bytes += len;
+    stats.queued_bytes += len;
+    if (stats.queued_bytes > stats.peak_queued_bytes)
+        stats.peak_queued_bytes = stats.queued_bytes;
+    return 0;
+}
+
+void outq_pop(Client *client) {
+    OutChunk *chunk = &client->outq[client->outq_head];
+    size_t remaining = chunk_len(chunk) - chunk->off;
+    client->out_bytes -= remaining;
+    stats.queued_bytes -= remaining;
+    frame_release(chunk->frame);
+    client->outq_head = (client->outq_head + 1) % client->outq_cap;
+    client->outq_count--;
+
+    // Une connexion inactive ne garde pas de file : la case retourne au pool
+    if (client->outq_count == 0 && client->outq_cap == OUTQ_INITIAL_CAP) {
+        outq_free_ring(client);
+        client->outq = NULL;
+        client->outq_head = 0;
+        client->outq_cap = 0;
+    }
+}
+
+// Retire de la file les n octets que le noyau vient d'accepter
+void outq_consume(Client *client, size_t n) {
+    while (n > 0) {
+        OutChunk *chunk = &client->outq[client->outq_head];
+        size_t remaining = chunk_len(chunk) - chunk->off;
+        if (n < remaining) {
+            chunk->off += n;
+            client->out_bytes -= n;
+            stats.queued_bytes -= n;
+            return;
+        }
+        n -= remaining;
+        outq_pop(client);
+    }
+}
+
+void outq_clear(Client *client) {
+    while (client->outq_count > 0)
+        outq_pop(client);
+    if (client->outq)
+        outq_free_ring(client);
+    client->outq = NULL;
+    client->outq_cap = 0;
+}
+
+// Applique les seuils haut/bas après une variation de la file de sortie
+void check_watermarks(Client *client) {
+    size_t held = client->out_bytes + (client->rbuf ? RBUF_SIZE : 0);
+    if (held > conn_mem_cap) {
+        fprintf(stderr, "Client %d too slow, dropping it (%zu bytes queued)\n",
+                client->fd, client->out_bytes);
+        stats.slow_drops++;
+        schedule_close(client);
+    } else if (!client->read_paused && client->out_bytes > high_watermark) {
+        client->read_paused = 1;
+        stats.paused_reads++;
+    }
+}
+
+// Envoie un vecteur d'octets en un seul appel système, sans bloquer
+ssize_t send_iov(int fd, struct iovec *iov, int iovcnt) {
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = iovcnt;
+
+    ssize_t n;
+    do {
+        n = sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    return n;
+}
+
+// Écrit autant que possible la file de sortie : jusqu'à FLUSH_IOV_MAX
+// fragments sont regroupés dans un seul sendmsg()
+void write_outq(Client *client) {
+    while (client->outq_count > 0) {
+        struct iovec iov[FLUSH_IOV_MAX];
+        int iovcnt = 0;
+        size_t total = 0;
+
+        for (int i = 0; i < client->outq_count && iovcnt + 2 <= FLUSH_IOV_MAX; i++) {
+            OutChunk *chunk = &client->outq[(client->outq_head + i) % client->outq_cap];
+            iovcnt += chunk_iov(chunk, iov + iovcnt);
+            total += chunk_len(chunk) - chunk->off;
+        }
+
+        ssize_t n = send_iov(client->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("sendmsg");
+                schedule_close(client);
+            }
+            break;
+        }
+        outq_consume(client, n);
+        if ((size_t)n < total)
+            break;
+    }
+}
+
+// Vide la file de sortie (sur EPOLLOUT ou en fin de lot) et reprend la
+// lecture si elle était suspendue
+void flush_client(Client *client) {
+    if (client->closing)
+        return;
+    write_outq(client);
+
+    if (client->read_paused && !client->closing && client->out_bytes <= low_watermark) {
+        client->read_paused = 0;
+        // En edge-triggered, les données arrivées pendant la pause ne
+        // déclencheront pas de nouvel événement : on les lit maintenant
+        handle_client_readable(client);
+    }
+}
+
+// Remplace le pseudo de la trame par une référence au dictionnaire du
+// client, en l'y définissant d'abord s'il n'y figure pas. Le dictionnaire
+// est à correspondance directe : une définition évince l'entrée en place.
+void intern_nick(Client *client, OutChunk *chunk) {
+    if (!client->nick_dict) {
+        client->nick_dict = pool_alloc(&dict_pool);
+        if (!client->nick_dict)
+            return;
+        memset(client->nick_dict, 0, NICK_DICT_SIZE * sizeof(uint32_t));
+    }
+
+    Frame *frame = chunk->frame;
+    int id = frame->nick_stamp % NICK_DICT_SIZE;
+    if (client->nick_dict[id] == frame->nick_stamp) {
+        chunk->prefix[0] = NICK_REF | id;
+        chunk->prefix_len = 1;
+        chunk->start = frame->nick_end;
+        stats.nick_refs++;
+        stats.nick_bytes_saved += frame->nick_end - 1;
+    } else {
+        client->nick_dict[id] = frame->nick_stamp;
+        chunk->prefix[0] = NICK_DEF;
+        chunk->prefix[1] = id;
+        chunk->prefix_len = 2;
+        stats.nick_defs++;
+    }
+}
+
+uint32_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int is_dirty(const Client *client) {
+    return client->dirty_pprev != NULL;
+}
+
+// Insère client en tête de dirty_clients
+void dirty_link(Client *client) {
+    client->dirty_next = dirty_clients;
+    if (dirty_clients)
+        dirty_clients->dirty_pprev = &client->dirty_next;
+    dirty_clients = client;
+    client->dirty_pprev = &dirty_clients;
+}
+
+// Retire client de la liste où il se trouve, dirty_clients ou la liste
+// détachée que parcourt flush_dirty_clients()
+void dirty_unlink(Client *client) {
+    *client->dirty_pprev = client->dirty_next;
+    if (client->dirty_next)
+        client->dirty_next->dirty_pprev = client->dirty_pprev;
+    client->dirty_pprev = NULL;
+    client->dirty_next = NULL;
+}
+
+// Clôt le lot d'un client avant l'écriture de sa file
+void end_batch(Client *client) {
+    stats.flushes++;
+    stats.flushed_frames += client->batch_frames;
+    if ((unsigned long)client->batch_frames > stats.max_batch)
+        stats.max_batch = client->batch_frames;
+    dirty_unlink(client);
+    client->batch_frames = 0;
+}
+
+// Envoie les lots arrivés à échéance ; renvoie le délai (ms) avant la
+// prochaine échéance, -1 s'il ne reste aucun lot. La liste est détachée
+// avant le parcours : un envoi peut reprendre une lecture dont les
+// traitements closent ou ouvrent d'autres lots, ce qui retire des clients
+// de la liste détachée ou en insère dans dirty_clients sans rompre le
+// parcours. Les lots pas encore échus y retournent ; ceux ouverts pendant
+// le parcours seront envoyés à l'itération suivante.
+int flush_dirty_clients(void) {
+    Client *pending = dirty_clients;
+    dirty_clients = NULL;
+    if (pending)
+        pending->dirty_pprev = &pending;
+    while (pending) {
+        Client *client = pending;
+        // Le lot d'un client en cours de fermeture part dans
+        // close_pending_clients()
+        if (!client->closing && (int32_t)(loop_time - client->batch_deadline) >= 0) {
+            end_batch(client);
+            flush_client(client);
+        } else {
+            dirty_unlink(client);
+            dirty_link(client);
+        }
+    }
+
+    int timeout = -1;
+    for (Client *client = dirty_clients; client; client = client->dirty_next) {
+        int32_t left = (int32_t)(client->batch_deadline - loop_time);
+        if (left < 0)
+            left = 0;
+        if (timeout < 0 || left < timeout)
+            timeout = left;
+    }
+    return timeout;
+}
+
+// Met une trame dans la file d'un client sans jamais bloquer. Si la file
+// était vide, la trame ouvre un lot envoyé en fin d'itération (ou à
+// l'échéance du délai de regroupement) ; si un lot est ouvert elle le
+// rejoint ; sinon la socket est pleine et la trame attend le prochain
+// EPOLLOUT.
+void client_send_frame(Client *client, Frame *frame) {
+    if (client->closing)
+        return;
+
+    OutChunk chunk = { frame, 0, 0, 0, { 0, 0 } };
+    if (frame->nick_stamp && client->proto_out == PROTO_V2)
+        intern_nick(client, &chunk);
+
+    int was_empty = client->outq_count == 0;
+    if (outq_push(client, &chunk) < 0) {
+        schedule_close(client);
+        return;
+    }
+
+    if (was_empty && !is_dirty(client)) {
+        client->batch_deadline = loop_time + coalesce_delay;
+        dirty_link(client);
+    }
+    if (is_dirty(client)) {
+        client->batch_frames++;
+        // Un lot assez gros pour remplir plusieurs segments n'a rien à
+        // gagner à attendre. Pas de reprise de lecture ici : on est peut-être
+        // en train de traiter les données d'un autre client.
+        if (client->out_bytes >= COALESCE_MAX_BYTES) {
+            end_batch(client);
+            write_outq(client);
+        }
+    }
+    check_watermarks(client);
+}
+
+// Envoie le message de set à client dans la version qu'il parle
+void frameset_send(FrameSet *set, Client *client) {
+    Frame **frame = &set->frames[client->proto_out];
+    if (!*frame) {
+        *frame = frame_create(client->proto_out, set->nick_sender, set->type,
+                              set->infos, set->payload, set->payload_len);
+        if (!*frame)
+            return;
+    }
+    client_send_frame(client, *frame);
+}
+
+void frameset_release(FrameSet *set) {
+    for (int proto = PROTO_LEGACY; proto <= PROTO_V2; proto++) {
+        if (set->frames[proto])
+            frame_release(set->frames[proto]);
+    }
+}
+
+void send_to_client(Client *client, const char *nick_sender, enum msg_type type,
+                    const char *infos, const char *payload, size_t len) {
+    Frame *frame = frame_create(client->proto_out, nick_sender, type, infos, payload, len);
+    if (!frame)
+        return;
+    client_send_frame(client, frame);
+    frame_release(frame);
+}
+
+// Envoie un texte produit par le serveur (chaîne terminée par NUL)
+void send_response(int fd, const char *nick_sender, enum msg_type type, 
+                  const char *infos, const char *text) {
+    size_t len = strlen(text);
+    Client *client = find_client(fd);
+    if (client) {
+        send_to_client(client, nick_sender, type, infos, text, len);
+        return;
+    }
+
+    // Socket sans Client associé (refus de connexion) : envoi best-effort
+    Frame *frame = frame_create(PROTO_LEGACY, nick_sender, type, infos, text, len);
+    if (!frame)
+        return;
+    send(fd, frame->data, frame->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+    frame_release(frame);
+}
+
+// Envoie une réponse de longueur quelconque en morceaux d'au plus
+// MAX_CHUNK_LEN octets
+void send_long_response(int fd, enum msg_type type, const char *infos,
+                        const char *text, size_t len) {
+    Client *client = find_client(fd);
+    if (!client)
+        return;
+    do {
+        size_t n = len > MAX_CHUNK_LEN ? MAX_CHUNK_LEN : len;
+        enum msg_type chunk_type = n < len ? type | MSG_TYPE_MORE : type;
+        send_to_client(client, "Server", chunk_type, infos, text, n);
+        text += n;
+        len -= n;
+    } while (len > 0);
+}
+
+int is_nickname_valid(const char *nickname) {
+    if (strlen(nickname) == 0 || strlen(nickname) >= NICK_LEN)
+        return 0;
+    
+    for (int i = 0; nickname[i]; i++) {
+        char c = nickname[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || 
+              (c >= '0' && c <= '9')))
+            return 0;
+    }
+    return 1;
+}
+
+Client *add_client(int fd, struct sockaddr_in addr) {
+    if (client_table_reserve(fd) < 0)
+        return NULL;
+
+    Client *new_client = pool_alloc(&client_pool);
+    if (!new_client)
+        return NULL;
+    
+    new_client->fd = fd;
+    new_client->addr = addr;
+    new_client->nickname[0] = '\0';
+    new_client->connection_time = time(NULL);
+    new_client->channel_id = -1;
+    new_client->channel_slot = -1;
+    new_client->proto_in = PROTO_LEGACY;
+    new_client->proto_out = PROTO_LEGACY;
+    new_client->nick_stamp = 0;
+    new_client->nick_dict = NULL;
+    new_client->rstate = READ_HEADER;
+    new_client->rlen = 0;
+    new_client->stream_len = 0;
+    new_client->stream_discard = 0;
+    new_client->stream_type = -1;
+    new_client->batch_frames = 0;
+    new_client->rbuf = NULL;
+    new_client->outq = NULL;
+    new_client->outq_head = 0;
+    new_client->outq_count = 0;
+    new_client->outq_cap = 0;
+    new_client->out_bytes = 0;
+    new_client->read_paused = 0;
+    new_client->closing = 0;
+    new_client->close_next = NULL;
+    new_client->dirty_pprev = NULL;
+    new_client->dirty_next = NULL;
+    new_client->prev = NULL;
+    new_client->next = clients;
+    if (clients)
+        clients->prev = new_client;
+    clients = new_client;
+    client_table[fd] = new_client;
+    num_clients++;
+
+    // L'infos de l'accueil, ignoré des anciens clients, annonce la v2
+    if (!greeting_frame) {
+        const char *text = "Please login with /nick <your pseudo>";
+        greeting_frame = frame_create(PROTO_LEGACY, "Server", ECHO_SEND, PROTO_ADVERTISE,
+                                      text, strlen(text));
+    }
+    if (greeting_frame)
+        client_send_frame(new_client, greeting_frame);
+    printf("New client connected: %s:%d\n", 
+           inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+    return new_client;
+}
+
+void remove_client(int fd) {
+    Client *tmp = find_client(fd);
+    if (tmp) {
+        close_chunk_stream(tmp);
+        // Un membre déconnecté ne doit pas rester dans l'ensemble du salon
+        leave_current_channel(tmp);
+
+        // Liste doublement chaînée : retrait en O(1)
+        if (tmp->prev)
+            tmp->prev->next = tmp->next;
+        else
+            clients = tmp->next;
+        if (tmp->next)
+            tmp->next->prev = tmp->prev;
+        client_table[fd] = NULL;
+        printf("Client removed: %s:%d\n", 
+               inet_ntoa(tmp->addr.sin_addr), ntohs(tmp->addr.sin_port));
+        if (tmp->nickname[0])
+            strmap_remove(&nick_index, tmp->nickname);
+        if (tmp->rbuf)
+            pool_free(&rbuf_pool, tmp->rbuf);
+        if (tmp->nick_dict)
+            pool_free(&dict_pool, tmp->nick_dict);
+        if (is_dirty(tmp))
+            dirty_unlink(tmp);
+        outq_clear(tmp);
+        drop_client_transfers(tmp, 0);
+        drop_client_relays(tmp);
+        pool_free(&client_pool, tmp);
+        num_clients--;
+    }
+}
+
+void broadcast_to_channel(Channel *channel, const char *sender, 
+                         const char *message, size_t len, enum msg_type type) {
+    // Sérialisée une fois par version, la trame est partagée par les membres
+    FrameSet set = { sender, type, channel->name, message, len, { NULL } };
+    for (int i = 0; i < channel->num_users; i++) {
+        frameset_send(&set, channel->members[i]);
+    }
+    frameset_release(&set);
+}
+
+int channel_add_member(Channel *channel, Client *client) {
+    if (channel->num_users == channel->members_cap) {
+        int new_cap = channel->members_cap ? channel->members_cap * 2 : 8;
+        Client **members = realloc(channel->members, new_cap * sizeof(Client *));
+        if (!members) {
+            perror("realloc");
+            return -1;
+        }
+        channel->members = members;
+        channel->members_cap = new_cap;
+    }
+    client->channel_slot = channel->num_users;
+    channel->members[channel->num_users++] = client;
+    client->channel_id = channel->id;
+    return 0;
+}
+
+// Retrait en O(1) : le dernier membre prend la place du partant
+void channel_remove_member(Channel *channel, Client *client) {
+    Client *last = channel->members[--channel->num_users];
+    channel->members[client->channel_slot] = last;
+    last->channel_slot = client->channel_slot;
+    client->channel_slot = -1;
+    client->channel_id = -1;
+}
+
+Channel* find_channel(const char *name) {
+    return strmap_get(&channel_index, name);
+}
+
+Channel *get_channel(int id) {
+    if (id < 0 || id >= channel_table_len)
+        return NULL;
+    return channel_table[id];
+}
+
+// Enregistre un salon sous un identifiant libre et l'indexe par son nom
+int register_channel(Channel *channel) {
+    if (num_free_channel_ids == 0 && channel_table_len == channel_table_cap) {
+        int new_cap = channel_table_cap ? channel_table_cap * 2 : MAX_CHANNELS;
+        Channel **table = realloc(channel_table, new_cap * sizeof(Channel *));
+        int *ids = realloc(free_channel_ids, new_cap * sizeof(int));
+        if (table)
+            channel_table = table;
+        if (ids)
+            free_channel_ids = ids;
+        if (!table || !ids) {
+            perror("realloc");
+            return -1;
+        }
+        channel_table_cap = new_cap;
+    }
+
+    if (strmap_put(&channel_index, channel->name, channel) < 0)
+        return -1;
+    if (num_free_channel_ids > 0)
+        channel->id = free_channel_ids[--num_free_channel_ids];
+    else
+        channel->id = channel_table_len++;
+    channel_table[channel->id] = channel;
+    return 0;
+}
+
+void unregister_channel(Channel *channel) {
+    strmap_remove(&channel_index, channel->name);
+    channel_table[channel->id] = NULL;
+    free_channel_ids[num_free_channel_ids++] = channel->id;
+}
+
+void leave_current_channel(Client *client) {
+    if (client->stream_type == MULTICAST_SEND)
+        close_chunk_stream(client);
+    if (client->channel_id >= 0) {
+        Channel *channel = get_channel(client->channel_id);
+        if (channel) {
+            char notice[256];
+            snprintf(notice, sizeof(notice), "%s has quit %s", 
+                    client->nickname, channel->name);
+            broadcast_to_channel(channel, "Server", notice, strlen(notice), MULTICAST_QUIT);
+            channel_remove_member(channel, client);
+            
+            if (channel->num_users == 0) {
+                send_response(client->fd, "Server", MULTICAST_QUIT, 
+                            channel->name, "You were the last user in this channel");
+
+                unregister_channel(channel);
+                free(channel->members);
+                pool_free(&channel_pool, channel);
+            }
+        }
+    }
+}
+
+void handle_nickname_new(int fd, struct message *msg) {
+    if (!is_nickname_valid(msg->infos)) {
+        send_response(fd, "Server", NICKNAME_NEW, "", "Invalid nickname format");
+        return;
+    }
+
+    Client *owner = find_client_by_nick(msg->infos);
+    if (owner && owner->fd != fd) {
+        send_response(fd, "Server", NICKNAME_NEW, "", "Nickname already taken");
+        return;
+    }
+
+    Client *client = find_client(fd);
+    if (!client)
+        return;
+
+    // L'index référence le pseudo du Client : on le retire avant de modifier
+    // la chaîne, puis on indexe le nouveau pseudo
+    if (client->nickname[0]) {
+        close_chunk_stream(client);
+        strmap_remove(&nick_index, client->nickname);
+        drop_client_transfers(client, 1);
+    }
+    strncpy(client->nickname, msg->infos, NICK_LEN - 1);
+    client->nickname[NICK_LEN - 1] = '\0';
+    client->nick_stamp = next_nick_stamp++;
+    if (strmap_put(&nick_index, client->nickname, client) < 0) {
+        client->nickname[0] = '\0';
+        send_response(fd, "Server", NICKNAME_NEW, "", "Server out of memory");
+        return;
+    }
+
+    // Construction sécurisée du message de bienvenue
+    char response[INFOS_LEN];
+    const char *prefix = "Welcome on the chat ";
+    size_t prefix_len = strlen(prefix);
+    size_t max_nick_len = INFOS_LEN - prefix_len - 1;
+
+    strncpy(response, prefix, INFOS_LEN - 1);
+    strncat(response, msg->infos, max_nick_len);
+    response[INFOS_LEN - 1] = '\0';
+
+    send_response(fd, "Server", NICKNAME_NEW, "", response);
+    printf("Client %d changed nickname to %s\n", fd, msg->infos);
+}
+
+void handle_who(int fd) {
+    char *user_list;
+    size_t len;
+    FILE *out = open_memstream(&user_list, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    fputs("Online users are:\n", out);
+    for (Client *curr = clients; curr != NULL; curr = curr->next) {
+        if (curr->nickname[0])
+            fprintf(out, "- %s\n", curr->nickname);
+    }
+    fclose(out);
+    send_long_response(fd, NICKNAME_LIST, "", user_list, len);
+    free(user_list);
+}
+
+void handle_whois(int fd, struct message *msg) {
+    Client *curr = find_client_by_nick(msg->infos);
+    if (curr) {
+        char time_str[30];
+        strftime(time_str, sizeof(time_str), "%Y/%m/%d@%H:%M", 
+                localtime(&curr->connection_time));
+        
+        char info[PAYLOAD_SIZE];
+        snprintf(info, PAYLOAD_SIZE, "%s connected since %s with IP address %s and port number %d",
+                curr->nickname, time_str, 
+                inet_ntoa(curr->addr.sin_addr), 
+                ntohs(curr->addr.sin_port));
+        
+        send_response(fd, "Server", NICKNAME_INFOS, "", info);
+        return;
+    }
+    send_response(fd, "Server", NICKNAME_INFOS, "", "User not found");
+}
+
+void handle_broadcast_send(int fd, struct message *msg, const char *payload, size_t len) {
+    Client *sender = find_client(fd);
+
+    if (!sender || !sender->nickname[0]) {
+        send_response(fd, "Server", BROADCAST_SEND, "", "You must set a nickname first");
+        return;
+    }
+
+    // Envoyer à tous les autres clients la même trame partagée
+    FrameSet set = { sender->nickname, msg->type, "", payload, len, { NULL } };
+    for (Client *curr = clients; curr != NULL; curr = curr->next) {
+        if (curr->fd != fd && curr->nickname[0]) {
+            frameset_send(&set, curr);
+        }
+    }
+    frameset_release(&set);
+}
+
+void handle_unicast_send(int fd, struct message *msg, const char *payload, size_t len) {
+    Client *sender = find_client(fd);
+
+    if (!sender || !sender->nickname[0]) {
+        send_response(fd, "Server", UNICAST_SEND, "", "You must set a nickname first");
+        return;
+    }
+
+    // Chercher le destinataire et envoyer le message
+    Client *dest = find_client_by_nick(msg->infos);
+    if (dest) {
+        send_to_client(dest, sender->nickname, msg->type, "", payload, len);
+        return;
+    }
+
+    // Construction sécurisée du message d'erreur : le pseudo est tronqué
+    // pour que le message tienne dans le champ infos
+    char error[INFOS_LEN];
+    const char *prefix = "User ";
+    const char *suffix = " does not exist";
+    int max_nick_len = INFOS_LEN - strlen(prefix) - strlen(suffix) - 1;
+
+    snprintf(error, sizeof(error), "%s%.*s%s", prefix, max_nick_len, msg->infos, suffix);
+
+    send_response(fd, "Server", UNICAST_SEND, "", error);
+}
+
+void handle_create_channel(int fd, struct message *msg) {
+    Client *client = find_client(fd);
+
+    if (!client || !client->nickname[0]) {
+        send_response(fd, "Server", MULTICAST_CREATE, "", "You must set a nickname first");
+        return;
+    }
+
+    if (!is_nickname_valid(msg->infos)) {
+        send_response(fd, "Server", MULTICAST_CREATE, "", "Invalid channel name");
+        return;
+    }
+
+    if (find_channel(msg->infos)) {
+        send_response(fd, "Server", MULTICAST_CREATE, "", "Channel already exists");
+        return;
+    }
+
+    // Créer le nouveau salon
+    Channel *new_channel = pool_alloc(&channel_pool);
+    if (!new_channel) {
+        send_response(fd, "Server", MULTICAST_CREATE, "", "Server out of memory");
+        return;
+    }
+
+    strncpy(new_channel->name, msg->infos, CHANNEL_NAME_LEN - 1);
+    new_channel->name[CHANNEL_NAME_LEN - 1] = '\0';
+    new_channel->members = NULL;
+    new_channel->num_users = 0;
+    new_channel->members_cap = 0;
+    if (register_channel(new_channel) < 0) {
+        pool_free(&channel_pool, new_channel);
+        send_response(fd, "Server", MULTICAST_CREATE, "", "Server out of memory");
+        return;
+    }
+
+    // Faire rejoindre le salon au créateur
+    leave_current_channel(client);
+    if (channel_add_member(new_channel, client) < 0) {
+        // Un salon sans membre ne doit pas rester enregistré : son nom et
+        // son identifiant redeviennent libres
+        unregister_channel(new_channel);
+        pool_free(&channel_pool, new_channel);
+        send_response(fd, "Server", MULTICAST_CREATE, "", "Server out of memory");
+        return;
+    }
+
+    send_response(fd, "Server", MULTICAST_CREATE, "", "Channel created successfully");
+    char join_msg[PAYLOAD_SIZE];
+    snprintf(join_msg, PAYLOAD_SIZE, "You have joined %s", msg->infos);
+    send_response(fd, "Server", MULTICAST_JOIN, msg->infos, join_msg);
+}
+
+void handle_channel_list(int fd) {
+    char *list;
+    size_t len;
+    FILE *out = open_memstream(&list, &len);
+    if (!out) {
+        perror("open_memstream");
+        return;
+    }
+    fputs("Available channels:\n", out);
+    for (int id = 0; id < channel_table_len; id++) {
+        Channel *curr = channel_table[id];
+        if (curr)
+            fprintf(out, "- %s (%d users)\n", curr->name, curr->num_users);
+    }
+    fclose(out);
+    send_long_response(fd, MULTICAST_LIST, "", list, len);
+    free(list);
+}
+
+void handle_join_channel(int fd, struct message *msg) {
+    Client *client = find_client(fd);
+
+    if (!client || !client->nickname[0]) {
+        send_response(fd, "Server", MULTICAST_JOIN, "", "You must set a nickname first");
+        return;
+    }
+
+    Channel *channel = find_channel(msg->infos);
+    if (!channel) {
+        send_response(fd, "Server", MULTICAST_JOIN, "", "Channel does not exist");
+        return;
+    }
+
+    if (client->channel_id == channel->id) {
+        send_response(fd, "Server", MULTICAST_JOIN, channel->name, "You are already in this channel");
+        return;
+    }
+
+    // Quitter le salon actuel si nécessaire
+    leave_current_channel(client);
+
+    // Rejoindre le nouveau salon
+    if (channel_add_member(channel, client) < 0) {
+        send_response(fd, "Server", MULTICAST_JOIN, "", "Server out of memory");
+        return;
+    }
+
+    // Notifier tout le monde
+    char notice[PAYLOAD_SIZE];
+    snprintf(notice, sizeof(notice), "%s has joined the channel", client->nickname);
+    broadcast_to_channel(channel, "Server", notice, strlen(notice), MULTICAST_JOIN);
+
+    char join_msg[PAYLOAD_SIZE];
+    snprintf(join_msg, PAYLOAD_SIZE, "You have joined %s", msg->infos);
+    send_response(fd, "Server", MULTICAST_JOIN, msg->infos, join_msg);
+}
+
+void handle_channel_message(int fd, struct message *msg, const char *payload, size_t len) {
+    Client *client = find_client(fd);
+
+    if (!client || !client->nickname[0]) {
+        send_response(fd, "Server", MULTICAST_SEND, "", "You must set a nickname first");
+        return;
+    }
+
+    Channel *channel = get_channel(client->channel_id);
+    if (!channel) {
+        send_response(fd, "Server", MULTICAST_SEND, "", "You must join a channel first");
+        return;
+    }
+
+    // Utiliser msg->infos pour vérifier si un canal spécifique est demandé
+    if (msg && msg->infos[0] != '\0') {
+        Channel *requested_channel = find_channel(msg->infos);
+        if (!requested_channel || requested_channel->id != client->channel_id) {
+            send_response(fd, "Server", MULTICAST_SEND, "", "Invalid channel or not your current channel");
+            return;
+        }
+    }
+
+    broadcast_to_channel(channel, client->nickname, payload, len, msg->type);
+}
+void handle_quit_channel(int fd, struct message *msg) {
+    Client *client = find_client(fd);
+
+    if (!client || !client->nickname[0]) {
+        send_response(fd, "Server", MULTICAST_QUIT, "", "You must set a nickname first");
+        return;
+    }
+
+    Channel *channel = find_channel(msg->infos);
+    if (!channel || channel->id != client->channel_id) {
+        send_response(fd, "Server", MULTICAST_QUIT, "", "You are not in this channel");
+        return;
+    }
+
+    leave_current_channel(client);
+}
+
+// Mémorise une demande d'envoi de fichier jusqu'à la réponse du
+// destinataire ; le payload est le nom du fichier, éventuellement suivi d'un
+// octet nul et du numéro de transfert de l'émetteur
+FileTransfer *add_transfer(Client *sender, Client *receiver, const char *payload,
+                           size_t len) {
+    FileTransfer *transfer = pool_alloc(&transfer_pool);
+    if (!transfer)
+        return NULL;
+    size_t filename_len = strnlen(payload, len);
+    transfer->id = transfer_tag_id(payload + filename_len, len - filename_len);
+    strncpy(transfer->sender_nick, sender->nickname, NICK_LEN - 1);
+    transfer->sender_nick[NICK_LEN - 1] = '\0';
+    strncpy(transfer->receiver_nick, receiver->nickname, NICK_LEN - 1);
+    transfer->receiver_nick[NICK_LEN - 1] = '\0';
+    if (filename_len >= sizeof(transfer->filename))
+        filename_len = sizeof(transfer->filename) - 1;
+    memcpy(transfer->filename, payload, filename_len);
+    transfer->filename[filename_len] = '\0';
+    transfer->next = pending_transfers;
+    pending_transfers = transfer;
+    return transfer;
+}
+
+// Retire de la liste la demande de sender à receiver portant le numéro id.
+// Si id vaut 0, c'est la plus ancienne : le destinataire répond aux
+// demandes dans leur ordre d'arrivée (la liste va de la plus récente à la
+// plus ancienne).
+FileTransfer *take_transfer(const char *sender_nick, const char *receiver_nick,
+                            unsigned int id) {
+    FileTransfer **found = NULL;
+    for (FileTransfer **link = &pending_transfers; *link; link = &(*link)->next) {
+        FileTransfer *transfer = *link;
+        if ((id == 0 || transfer->id == id) &&
+            strcmp(transfer->sender_nick, sender_nick) == 0 &&
+            strcmp(transfer->receiver_nick, receiver_nick) == 0) {
+            found = link;
+            if (id != 0)
+                break;
+        }
+    }
+    if (!found)
+        return NULL;
+    FileTransfer *transfer = *found;
+    *found = transfer->next;
+    return transfer;
+}
+
+// Envoie à client un FILE_REJECT qui rappelle le numéro du transfert
+void send_transfer_reject(Client *client, const char *nick_sender, const char *infos,
+                          FileTransfer *transfer, const char *reason) {
+    char text[PAYLOAD_SIZE];
+    int len = transfer->id ? snprintf(text, sizeof(text), "%s" TRANSFER_TAG "%u", reason, transfer->id)
+                           : snprintf(text, sizeof(text), "%s", reason);
+    send_to_client(client, nick_sender, FILE_REJECT, infos, text, len);
+}
+
+// Les demandes sont identifiées par pseudo : on oublie celles d'un client
+// qui part ou change de pseudo. Chaque côté encore présent reçoit un
+// FILE_REJECT qui porte le numéro du transfert : l'émetteur de la part du
+// destinataire, le destinataire de la part de "Server" (comme pour un
+// relais impossible). Le client lui-même n'est prévenu que s'il reste
+// connecté (notify_client), son pseudo étant déjà retiré de l'index.
+void drop_client_transfers(Client *client, int notify_client) {
+    if (!client->nickname[0])
+        return;
+    FileTransfer **link = &pending_transfers;
+    while (*link) {
+        FileTransfer *transfer = *link;
+        int is_sender = strcmp(transfer->sender_nick, client->nickname) == 0;
+        if (!is_sender && strcmp(transfer->receiver_nick, client->nickname) != 0) {
+            link = &transfer->next;
+            continue;
+        }
+        *link = transfer->next;
+
+        const char *reason = is_sender ? "Sender left or changed nickname"
+                                       : "Recipient left or changed nickname";
+        Client *sender = is_sender ? (notify_client ? client : NULL)
+                                   : find_client_by_nick(transfer->sender_nick);
+        Client *receiver = !is_sender ? (notify_client ? client : NULL)
+                                      : find_client_by_nick(transfer->receiver_nick);
+        if (sender)
+            send_transfer_reject(sender, transfer->receiver_nick, transfer->receiver_nick,
+                                 transfer, reason);
+        if (receiver)
+            send_transfer_reject(receiver, "Server", transfer->sender_nick, transfer, reason);
+        pool_free(&transfer_pool, transfer);
+    }
+}
+
+// Refuse la demande de fichier de fd : le refus porte en infos le
+// destinataire demandé et rappelle le numéro de transfert de l'émetteur
+void refuse_file_request(int fd, struct message *msg, const char *payload, size_t len,
+                         const char *reason) {
+    size_t filename_len = strnlen(payload, len);
+    unsigned int id = transfer_tag_id(payload + filename_len, len - filename_len);
+    char text[PAYLOAD_SIZE];
+    if (id)
+        snprintf(text, sizeof(text), "%s" TRANSFER_TAG "%u", reason, id);
+    else
+        snprintf(text, sizeof(text), "%s", reason);
+    send_response(fd, "Server", FILE_REQUEST, msg->infos, text);
+}
+
+void handle_file_request(int fd, struct message *msg, const char *payload, size_t len) {
+    // Trouver l'émetteur et le récepteur
+    Client *sender = find_client(fd);
+    Client *receiver = find_client_by_nick(msg->infos);
+
+    if (!sender || !sender->nickname[0]) {
+        refuse_file_request(fd, msg, payload, len, "You must set a nickname first");
+        return;
+    }
+
+    if (!receiver) {
+        refuse_file_request(fd, msg, payload, len, "Recipient not found");
+        return;
+    }
+
+    FileTransfer *transfer = add_transfer(sender, receiver, payload, len);
+    if (!transfer) {
+        refuse_file_request(fd, msg, payload, len, "Server out of memory");
+        return;
+    }
+
+    printf("File request from %s to %s: %s\n", sender->nickname, receiver->nickname,
+           transfer->filename);
+
+    // Transmettre la demande au récepteur
+    send_to_client(receiver, sender->nickname, FILE_REQUEST, "", payload, len);
+}
+
+// Tire un jeton de relais aléatoire, absent de relay_index
+void make_relay_token(char *token) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char raw[RELAY_TOKEN_LEN / 2];
+    do {
+        if (getrandom(raw, sizeof(raw), 0) != sizeof(raw)) {
+            for (size_t i = 0; i < sizeof(raw); i++)
+                raw[i] = rand();
+        }
+        for (size_t i = 0; i < sizeof(raw); i++) {
+            token[2 * i] = hex[raw[i] >> 4];
+            token[2 * i + 1] = hex[raw[i] & 0xf];
+        }
+        token[RELAY_TOKEN_LEN] = '\0';
+    } while (strmap_get(&relay_index, token));
+}
+
+Relay *create_relay(Client *sender, Client *receiver, const char *filename) {
+    Relay *relay = calloc(1, sizeof(Relay));
+    if (!relay) {
+        perror("calloc");
+        return NULL;
+    }
+    if (pipe2(relay->pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        perror("pipe2");
+        free(relay);
+        return NULL;
+    }
+    // Un tube plus grand que les 64 Ko par défaut laisse passer plus de
+    // données par appel ; à défaut on garde la taille par défaut
+    int cap = fcntl(relay->pipe[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    if (cap < 0)
+        cap = fcntl(relay->pipe[1], F_GETPIPE_SZ);
+    relay->pipe_cap = cap > 0 ? cap : 65536;
+
+    make_relay_token(relay->token);
+    relay->deadline = monotonic_ms() + RELAY_CONNECT_TIMEOUT_MS;
+    strcpy(relay->sender_nick, sender->nickname);
+    strcpy(relay->receiver_nick, receiver->nickname);
+    strcpy(relay->filename, filename);
+    if (strmap_put(&relay_index, relay->token, relay) < 0) {
+        close(relay->pipe[0]);
+        close(relay->pipe[1]);
+        free(relay);
+        return NULL;
+    }
+    relay->next = relays;
+    if (relays)
+        relays->prev = relay;
+    relays = relay;
+    return relay;
+}
+
+// Libère un relais et ferme ses connexions de données
+void destroy_relay(Relay *relay) {
+    strmap_remove(&relay_index, relay->token);
+    if (relay->prev)
+        relay->prev->next = relay->next;
+    else
+        relays = relay->next;
+    if (relay->next)
+        relay->next->prev = relay->prev;
+
+    RelayEnd *ends[] = { relay->src, relay->dst };
+    for (int i = 0; i < 2; i++) {
+        if (ends[i]) {
+            close(ends[i]->fd);
+            free(ends[i]);
+        }
+    }
+    close(relay->pipe[0]);
+    close(relay->pipe[1]);
+    free(relay);
+}
+
+// Un relais dont une connexion de données manque encore n'aboutira pas si
+// l'émetteur ou le destinataire quitte le serveur
+void drop_client_relays(Client *client) {
+    if (!client->nickname[0])
+        return;
+    Relay *relay = relays;
+    while (relay) {
+        Relay *next = relay->next;
+        if (!relay->closing && (!relay->src || !relay->dst) &&
+            (strcmp(relay->sender_nick, client->nickname) == 0 ||
+             strcmp(relay->receiver_nick, client->nickname) == 0)) {
+            destroy_relay(relay);
+        }
+        relay = next;
+    }
+}
+
+// Annonce à l'émetteur le refus de sa demande, avec son numéro de transfert
+void reject_transfer(Client *sender, Client *receiver, FileTransfer *transfer,
+                     const char *reason) {
+    send_transfer_reject(sender, receiver->nickname, receiver->nickname, transfer, reason);
+}
+
+// Le relais demandé est impossible : l'émetteur voit un refus, le
+// destinataire un FILE_REJECT du serveur qui lui fait abandonner la réception
+void reject_relayed_transfer(Client *sender, Client *receiver, FileTransfer *transfer,
+                             const char *reason) {
+    send_transfer_reject(receiver, "Server", sender->nickname, transfer, reason);
+    reject_transfer(sender, receiver, transfer, reason);
+}
+
+// Le destinataire demande que le fichier passe par le serveur : chacun des
+// deux reçoit l'adresse du relais et son jeton, suivis de l'éventuelle
+// demande de reprise du destinataire (suffix)
+void accept_relayed_transfer(Client *sender, Client *receiver, FileTransfer *transfer,
+                             const char *suffix, size_t suffix_len) {
+    if (relay_port == 0) {
+        reject_relayed_transfer(sender, receiver, transfer, "File relay is disabled on this server");
+        return;
+    }
+
+    Relay *relay = create_relay(sender, receiver, transfer->filename);
+    if (!relay) {
+        reject_relayed_transfer(sender, receiver, transfer, "Server out of memory");
+        return;
+    }
+
+    char address[PAYLOAD_SIZE];
+    if (suffix_len > sizeof(address) / 2)
+        suffix_len = 0;
+    int len = snprintf(address, sizeof(address), RELAY_PREFIX "%d:%s%.*s", relay_port,
+                       relay->token, (int)suffix_len, suffix);
+    printf("File accept from %s to %s through relay %s\n",
+           receiver->nickname, sender->nickname, relay->token);
+
+    send_to_client(sender, receiver->nickname, FILE_ACCEPT, receiver->nickname, address, len);
+    send_to_client(receiver, sender->nickname, FILE_SEND, sender->nickname, address, len);
+}
+
+void handle_file_accept(int fd, struct message *msg, const char *payload, size_t len) {
+    // Trouver le récepteur (celui qui accepte) et l'émetteur
+    Client *receiver = find_client(fd);
+    Client *sender = find_client_by_nick(msg->infos);
+
+    if (!receiver || !sender) {
+        printf("Sender or receiver not found in file accept\n");
+        return;
+    }
+
+    FileTransfer *transfer = take_transfer(sender->nickname, receiver->nickname,
+                                           transfer_tag_id(payload, len));
+    if (!transfer) {
+        send_response(fd, "Server", ECHO_SEND, "", "No pending file request from this user");
+        return;
+    }
+
+    // "relay", éventuellement suivi d'une demande de reprise à transmettre
+    size_t relay_len = strlen(RELAY_REQUEST);
+    if (len >= relay_len && memcmp(payload, RELAY_REQUEST, relay_len) == 0 &&
+        (len == relay_len || payload[relay_len] == ';')) {
+        accept_relayed_transfer(sender, receiver, transfer, payload + relay_len, len - relay_len);
+        pool_free(&transfer_pool, transfer);
+        return;
+    }
+    pool_free(&transfer_pool, transfer);
+
+    printf("File accept from %s to %s with address %.*s\n", 
+           receiver->nickname, sender->nickname, (int)len, payload);
+
+    // Envoyer les informations de connexion à l'émetteur
+    send_to_client(sender, receiver->nickname, FILE_ACCEPT, receiver->nickname, payload, len);
+}
+
+void handle_file_reject(int fd, struct message *msg, const char *payload, size_t len) {
+    // Trouver le récepteur (celui qui refuse) et l'émetteur
+    Client *receiver = find_client(fd);
+    Client *sender = find_client_by_nick(msg->infos);
+
+    if (!receiver || !sender) {
+        printf("Sender or receiver not found in file reject\n");
+        return;
+    }
+
+    FileTransfer *transfer = take_transfer(sender->nickname, receiver->nickname,
+                                           transfer_tag_id(payload, len));
+    if (!transfer) {
+        send_response(fd, "Server", ECHO_SEND, "", "No pending file request from this user");
+        return;
+    }
+
+    printf("File reject from %s to %s\n", receiver->nickname, sender->nickname);
+
+    // Notifier l'émetteur
+    reject_transfer(sender, receiver, transfer, "File transfer was rejected");
+    pool_free(&transfer_pool, transfer);
+}
+
+// Passage en v2 : les trames reçues après celle-ci sont en v2, puis
+// l'acquittement part au format précédent et les suivantes en v2
+void handle_proto_negotiate(int fd, struct message *msg) {
+    Client *client = find_client(fd);
+    if (!client)
+        return;
+
+    if (atoi(msg->infos) == PROTO_V2)
+        client->proto_in = PROTO_V2;
+    char version[16];
+    snprintf(version, sizeof(version), "%d", client->proto_in);
+    send_to_client(client, "Server", PROTO_NEGOTIATE, version, NULL, 0);
+    client->proto_out = client->proto_in;
+}
+
+// Suit la longueur du message en plusieurs morceaux dont fait partie msg ;
+// retourne 0 si le morceau doit être ignoré. Le morceau qui dépasse
+// max_message_size est remplacé par un dernier morceau vide, qui clôt le
+// message chez les destinataires.
+int account_chunk(Client *client, struct message *msg, size_t *len) {
+    int more = msg->type & MSG_TYPE_MORE;
+    if (client->stream_discard) {
+        client->stream_discard = more;
+        return 0;
+    }
+
+    client->stream_len += *len;
+    if (client->stream_len > max_message_size) {
+        msg->type &= ~MSG_TYPE_MORE;
+        *len = 0;
+        client->stream_discard = more;
+        client->stream_len = 0;
+        client->stream_type = -1;
+        stats.truncated++;
+        send_response(client->fd, "Server", ECHO_SEND, "", "Message too long, truncated");
+        return 1;
+    }
+    if (!more) {
+        client->stream_len = 0;
+        client->stream_type = -1;
+        return 1;
+    }
+    if (client->stream_type < 0) {
+        client->stream_type = msg->type & ~MSG_TYPE_MORE;
+        Client *dest = find_client_by_nick(msg->infos);
+        client->stream_dest = dest ? dest->fd : -1;
+        client->stream_dest_stamp = dest ? dest->nick_stamp : 0;
+    }
+    return 1;
+}
+
+// Clôt le message en plusieurs morceaux resté ouvert (déconnexion, changement
+// de pseudo ou de salon) par un dernier morceau vide : sans lui, le reste
+// serait collé par les destinataires au message suivant du même pseudo.
+void close_chunk_stream(Client *client) {
+    int type = client->stream_type;
+    if (type < 0)
+        return;
+    client->stream_type = -1;
+    client->stream_len = 0;
+
+    struct message msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    switch (type) {
+        case BROADCAST_SEND:
+            handle_broadcast_send(client->fd, &msg, "", 0);
+            break;
+        case UNICAST_SEND:
+            {
+                // Un destinataire parti, ou dont le descripteur a été
+                // réutilisé, n'a plus de message partiel à clore
+                Client *dest = find_client(client->stream_dest);
+                if (dest && dest->nickname[0] && dest->nick_stamp == client->stream_dest_stamp)
+                    send_to_client(dest, client->nickname, type, "", "", 0);
+            }
+            break;
+        case MULTICAST_SEND:
+            handle_channel_message(client->fd, &msg, "", 0);
+            break;
+        default:
+            // ECHO_SEND : seul l'émetteur attend la fin du message
+            send_to_client(client, "Server", type, "", "", 0);
+    }
+}
+
+void handle_client_message(int fd, struct message *msg, const char *data, size_t len) {
+    enum msg_type type = msg->type & ~MSG_TYPE_MORE;
+    if (type == BROADCAST_SEND || type == UNICAST_SEND ||
+        type == MULTICAST_SEND || type == ECHO_SEND) {
+        Client *client = find_client(fd);
+        if (client && !account_chunk(client, msg, &len))
+            return;
+    }
+
+    // Le payload est transmis tel quel (data, len) jusqu'aux trames sortantes
+    switch (type) {
+        case NICKNAME_NEW:
+            handle_nickname_new(fd, msg);
+            break;
+        case NICKNAME_LIST:
+            handle_who(fd);
+            break;
+        case NICKNAME_INFOS:
+            handle_whois(fd, msg);
+            break;
+        case BROADCAST_SEND:
+            handle_broadcast_send(fd, msg, data, len);
+            break;
+        case UNICAST_SEND:
+            handle_unicast_send(fd, msg, data, len);
+            break;
+        case MULTICAST_CREATE:
+            handle_create_channel(fd, msg);
+            break;
+        case MULTICAST_LIST:
+            handle_channel_list(fd);
+            break;
+        case MULTICAST_JOIN:
+            handle_join_channel(fd, msg);
+            break;
+        case MULTICAST_SEND:
+            handle_channel_message(fd, msg, data, len);
+            break;
+        case MULTICAST_QUIT:
+            handle_quit_channel(fd, msg);
+            break;
+        case ECHO_SEND:
+            {
+                Client *client = find_client(fd);
+                if (client)
+                    send_to_client(client, "Server", msg->type, "", data, len);
+            }
+            break;
+        case FILE_REQUEST:
+            printf("Received file request\n");
+            handle_file_request(fd, msg, data, len);
+            break;
+
+        case FILE_ACCEPT:
+            printf("Received file accept\n");
+            handle_file_accept(fd, msg, data, len);
+            break;
+
+        case FILE_REJECT:
+            printf("Received file reject\n");
+            handle_file_reject(fd, msg, data, len);
+            break;
+
+        case FILE_ACK:
+            // Transmettre l'accusé de réception à l'émetteur
+            {
+                Client *dest = find_client_by_nick(msg->infos);
+                if (dest)
+                    send_to_client(dest, msg->nick_sender, FILE_ACK, msg->infos, data, len);
+            }
+            break;
+        case PROTO_NEGOTIATE:
+            handle_proto_negotiate(fd, msg);
+            break;
+        default:
+            fprintf(stderr, "Unknown message type\n");
+    }
+}
+
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+// Relève la limite de descripteurs ouverts pour tenir TARGET_CONNECTIONS
+// connexions simultanées (la limite par défaut est souvent de 1024)
+void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        perror("getrlimit");
+        return;
+    }
+
+    rlim_t wanted = TARGET_CONNECTIONS + 64;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < wanted) {
+        // Seul un processus privilégié peut relever la limite dure
+        struct rlimit raised = { wanted, wanted };
+        if (setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+            rl = raised;
+        }
+    }
+
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        perror("setrlimit");
+    }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        printf("File descriptor limit: %lu\n", (unsigned long)rl.rlim_cur);
+    }
+}
+
+int create_listening_socket(const char *port) {
+    int sfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sfd == -1) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    int opt = 1;
+    if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in addr;
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(port));
+    addr.sin_addr.s_addr = INADDR_ANY;
+
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(sfd, SOMAXCONN) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+
+    // La socket d'écoute est non bloquante : en mode edge-triggered on
+    // accepte jusqu'à EAGAIN
+    if (set_nonblocking(sfd) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    return sfd;
+}
+
+// Ferme les clients programmés pendant l'itération : la fermeture du fd
+// le retire aussi de l'epoll
+void close_pending_clients(void) {
+    while (closing_clients) {
+        Client *client = closing_clients;
+        int fd = client->fd;
+        closing_clients = client->close_next;
+        if (is_dirty(client)) {
+            // Dernière tentative, sans attendre, pour le lot en attente
+            // (réponse à une requête suivie d'un EOF)
+            end_batch(client);
+            write_outq(client);
+        }
+        remove_client(fd);
+        close(fd);
+    }
+}
+
+void unlink_pending_end(RelayEnd *end) {
+    if (end->prev)
+        end->prev->next = end->next;
+    else
+        pending_ends = end->next;
+    if (end->next)
+        end->next->prev = end->prev;
+    else
+        pending_ends_tail = end->prev;
+    num_pending_ends--;
+}
+
+// Ferme une connexion de données qui n'a pas présenté de jeton valide. Elle
+// n'est libérée qu'en fin d'itération, un événement déjà reçu pouvant
+// encore la désigner.
+void drop_pending_end(RelayEnd *end) {
+    unlink_pending_end(end);
+    close(end->fd);
+    end->fd = -1;
+    end->next = dead_ends;
+    dead_ends = end;
+    stats.relay_ends_dropped++;
+}
+
+// Accepte les connexions de données en attente sur le port de relais ;
+// elles attendent leur jeton avant d'être rattachées à un relais
+void accept_relay_connections(int rfd) {
+    while (1) {
+        int fd = accept4(rfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        RelayEnd *end = malloc(sizeof(RelayEnd));
+        if (!end) {
+            perror("malloc");
+            close(fd);
+            continue;
+        }
+        end->fd = fd;
+        end->relay = NULL;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = (void *)((uintptr_t)end | RELAY_TAG);
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(fd);
+            free(end);
+            continue;
+        }
+
+        // Au-delà de la limite, la plus ancienne connexion sans jeton cède
+        // sa place : un client légitime envoie le sien dès la connexion
+        if (num_pending_ends >= MAX_PENDING_RELAY_ENDS)
+            drop_pending_end(pending_ends);
+        end->deadline = monotonic_ms() + RELAY_CONNECT_TIMEOUT_MS;
+        end->next = NULL;
+        end->prev = pending_ends_tail;
+        if (pending_ends_tail)
+            pending_ends_tail->next = end;
+        else
+            pending_ends = end;
+        pending_ends_tail = end;
+        num_pending_ends++;
+    }
+}
+
+// Lit le jeton et le rôle d'une connexion de données et la rattache à son
+// relais. Le jeton n'est consommé qu'une fois entier, pour ne jamais lire
+// les octets du fichier qui le suivent. Retourne 1 si la connexion est
+// rattachée, 0 s'il faut attendre la suite, -1 si elle doit être fermée.
+int relay_attach(RelayEnd *end) {
+    char hello[RELAY_HELLO_LEN];
+    ssize_t n = recv(end->fd, hello, sizeof(hello), MSG_PEEK);
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    if (n == 0)
+        return -1;
+    if (n < RELAY_HELLO_LEN)
+        return 0;
+    if (recv(end->fd, hello, sizeof(hello), 0) != RELAY_HELLO_LEN)
+        return -1;
+
+    char role = hello[RELAY_TOKEN_LEN];
+    hello[RELAY_TOKEN_LEN] = '\0';
+    Relay *relay = strmap_get(&relay_index, hello);
+    if (!relay || relay->closing)
+        return -1;
+    RelayEnd **slot = role == RELAY_ROLE_SENDER ? &relay->src :
+                      role == RELAY_ROLE_RECEIVER ? &relay->dst : NULL;
+    if (!slot || *slot)
+        return -1;
+
+    *slot = end;
+    end->relay = relay;
+    if (relay->src && relay->dst)
+        clock_gettime(CLOCK_MONOTONIC, &relay->start);
+    return 1;
+}
+
+// Fait passer par le tube tout ce que la connexion de l'émetteur a reçu et
+// que celle du destinataire peut accepter. Retourne 1 quand le fichier est
+// entièrement transmis, 0 s'il faut attendre, -1 en cas d'erreur.
+int relay_pump(Relay *relay) {
+    while (1) {
+        int progress = 0;
+
+        if (!relay->src_eof && relay->in_pipe < relay->pipe_cap) {
+            ssize_t n = splice(relay->src->fd, NULL, relay->pipe[1], NULL,
+                               relay->pipe_cap - relay->in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->in_pipe += n;
+                progress = 1;
+            } else if (n == 0) {
+                relay->src_eof = 1;
+            } else if (errno != EAGAIN && errno != EINTR) {
+                perror("splice");
+                return -1;
+            }
+        }
+
+        if (relay->in_pipe > 0) {
+            ssize_t n = splice(relay->pipe[0], NULL, relay->dst->fd, NULL, relay->in_pipe,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                relay->in_pipe -= n;
+                relay->bytes += n;
+                progress = 1;
+            } else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("splice");
+                return -1;
+            }
+        }
+
+        if (relay->src_eof && relay->in_pipe == 0)
+            return 1;
+        if (!progress)
+            return 0;
+    }
+}
+
+// Termine un relais en affichant son débit ; il est détruit en fin
+// d'itération, les événements déjà reçus pouvant encore désigner ses
+// connexions
+void finish_relay(Relay *relay, int complete) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - relay->start.tv_sec) +
+                     (now.tv_nsec - relay->start.tv_nsec) / 1e9;
+    printf("Relay %s: %s -> %s \"%s\" %s, %zu bytes in %.3f s (%.1f MB/s)\n",
+           relay->token, relay->sender_nick, relay->receiver_nick, relay->filename,
+           complete ? "done" : "interrupted", relay->bytes, elapsed,
+           elapsed > 0 ? relay->bytes / elapsed / 1e6 : 0.0);
+
+    if (complete)
+        stats.relays_done++;
+    else
+        stats.relays_failed++;
+    stats.relayed_bytes += relay->bytes;
+    relay->closing = 1;
+    relay->close_next = closing_relays;
+    closing_relays = relay;
+}
+
+void handle_relay_event(RelayEnd *end, uint32_t events) {
+    if (end->fd < 0)
+        return;
+    if (!end->relay) {
+        int attached = relay_attach(end);
+        if (attached < 0) {
+            drop_pending_end(end);
+            return;
+        }
+        if (attached == 0)
+            return;
+        unlink_pending_end(end);
+    }
+
+    Relay *relay = end->relay;
+    if (relay->closing || !relay->src || !relay->dst)
+        return;
+
+    int status = relay_pump(relay);
+    // Le destinataire qui ferme avant la fin interrompt le transfert
+    if (status == 0 && end == relay->dst && (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+        status = -1;
+    if (status != 0)
+        finish_relay(relay, status > 0);
+}
+
+void close_finished_relays(void) {
+    while (closing_relays) {
+        Relay *relay = closing_relays;
+        closing_relays = relay->close_next;
+        destroy_relay(relay);
+    }
+    while (dead_ends) {
+        RelayEnd *end = dead_ends;
+        dead_ends = end->next;
+        free(end);
+    }
+}
+
+// Ferme les connexions de données restées sans jeton et abandonne les
+// relais dont les deux connexions ne sont pas arrivées à temps, en fermant
+// celle qui attend ; renvoie le délai (ms) avant la prochaine échéance, -1
+// s'il n'y en a pas
+int expire_relays(void) {
+    uint32_t now = monotonic_ms();
+    int timeout = -1;
+    // La liste est triée par échéance : seule la tête est à examiner
+    while (pending_ends && (int32_t)(pending_ends->deadline - now) <= 0)
+        drop_pending_end(pending_ends);
+    if (pending_ends)
+        timeout = (int32_t)(pending_ends->deadline - now);
+
+    Relay *relay = relays;
+    while (relay) {
+        Relay *next = relay->next;
+        if (!relay->closing && (!relay->src || !relay->dst)) {
+            int32_t left = (int32_t)(relay->deadline - now);
+            if (left <= 0) {
+                printf("Relay %s: %s -> %s \"%s\" expired\n", relay->token,
+                       relay->sender_nick, relay->receiver_nick, relay->filename);
+                stats.relays_failed++;
+                destroy_relay(relay);
+            } else if (timeout < 0 || left < timeout) {
+                timeout = left;
+            }
+        }
+        relay = next;
+    }
+    return timeout;
+}
+
+void handle_sigusr1(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+void print_stats(void) {
+    int paused = 0, compact = 0;
+    for (Client *curr = clients; curr != NULL; curr = curr->next) {
+        if (curr->read_paused)
+            paused++;
+        if (curr->proto_out == PROTO_V2)
+            compact++;
+    }
+    printf("Stats: %d clients (%d v2), %zu bytes queued (peak %zu) in %lu shared frames "
+           "(%zu bytes), %d paused readers, %lu pauses, %lu slow clients dropped\n",
+           num_clients, compact, stats.queued_bytes, stats.peak_queued_bytes, stats.frames_live,
+           stats.frame_bytes_live, paused, stats.paused_reads, stats.slow_drops);
+    printf("Streams: %lu messages truncated (max %zu bytes)\n",
+           stats.truncated, max_message_size);
+    printf("Coalescing: %lu flushes, %lu frames (%.2f per flush, max %lu), delay %u ms\n",
+           stats.flushes, stats.flushed_frames,
+           stats.flushes ? (double)stats.flushed_frames / stats.flushes : 0.0,
+           stats.max_batch, coalesce_delay);
+    printf("Nick dictionary: %lu references, %lu definitions, %zu bytes saved\n",
+           stats.nick_refs, stats.nick_defs, stats.nick_bytes_saved);
+    if (relay_port) {
+        printf("Relay: %zu active, %lu done, %lu interrupted, %llu bytes relayed\n",
+               relay_index.count, stats.relays_done, stats.relays_failed, stats.relayed_bytes);
+        printf("Relay connections: %d awaiting a token (max %d), %lu dropped\n",
+               num_pending_ends, MAX_PENDING_RELAY_ENDS, stats.relay_ends_dropped);
+    }
+    Pool *pools[] = { &client_pool, &channel_pool, &transfer_pool,
+                      &rbuf_pool, &dict_pool, &outq_pool };
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        Pool *pool = pools[i];
+        printf("Pool %s: %lu in use (peak %lu), %lu allocations, "
+               "%lu slabs of %zu x %zu bytes\n",
+               pool->name, pool->in_use, pool->peak_in_use, pool->allocs,
+               pool->num_slabs, pool->objs_per_slab, pool->obj_size);
+    }
+    fflush(stdout);
+}
+
+// Accepte toutes les connexions en attente (epoll en mode edge-triggered)
+void accept_new_clients(int sfd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept(sfd, (struct sockaddr *)&client_addr, &client_len);
+
+        if (client_fd < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && spare_fd >= 0) {
+                // Plus de descripteur : on libère le descripteur de réserve
+                // pour accepter puis refuser la connexion, sinon elle
+                // resterait indéfiniment dans la file d'attente
+                close(spare_fd);
+                client_fd = accept(sfd, NULL, NULL);
+                if (client_fd >= 0) {
+                    send_response(client_fd, "Server", ECHO_SEND, "", "Server is full");
+                    close(client_fd);
+                }
+                spare_fd = open("/dev/null", O_RDONLY);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            return;
+        }
+
+        if (set_nonblocking(client_fd) < 0) {
+            close(client_fd);
+            continue;
+        }
+
+        Client *client = add_client(client_fd, client_addr);
+        if (!client) {
+            close(client_fd);
+            continue;
+        }
+
+        // Le pointeur vers le Client est porté directement par l'événement.
+        // EPOLLOUT est armé en permanence : en edge-triggered il ne se
+        // déclenche que lorsque la socket redevient inscriptible.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        ev.data.ptr = client;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl");
+            schedule_close(client);
+        }
+    }
+}
+
+// Vérifie un en-tête reçu avant d'attendre son payload
+int is_header_valid(struct message *msg) {
+    if (msg->pld_len < 0 || msg->pld_len >= PAYLOAD_SIZE)
+        return 0;
+    msg->nick_sender[NICK_LEN - 1] = '\0';
+    msg->infos[INFOS_LEN - 1] = '\0';
+    return 1;
+}
+
+// Décode l'en-tête d'une trame dans la version parlée par le client ;
+// retourne sa taille sur le fil, 0 s'il est incomplet, -1 s'il est invalide
+int decode_header(Client *client, const char *buf, size_t len, struct message *msg) {
+    if (client->proto_in == PROTO_V2)
+        return v2_decode_header(buf, len, msg, NULL);
+    if (len < HEADER_SIZE)
+        return 0;
+    memcpy(msg, buf, HEADER_SIZE);
+    return HEADER_SIZE;
+}
+
+// Prend le tampon de trame partielle dans son pool à la première lecture
+// incomplète
+int ensure_rbuf(Client *client) {
+    if (!client->rbuf) {
+        client->rbuf = pool_alloc(&rbuf_pool);
+        if (!client->rbuf)
+            return -1;
+    }
+    return 0;
+}
+
+// Complète rbuf jusqu'à need octets avec les données reçues
+int buffer_input(Client *client, const char **data, size_t *len, size_t need) {
+    if (ensure_rbuf(client) < 0)
+        return -1;
+    size_t n = need - client->rlen;
+    if (n > *len)
+        n = *len;
+    memcpy(client->rbuf + client->rlen, *data, n);
+    client->rlen += n;
+    *data += n;
+    *len -= n;
+    return 0;
+}
+
+// Machine à états de réassemblage : en-tête -> payload -> dispatch.
+// Toutes les trames complètes présentes dans data sont traitées sans copie ;
+// seule une trame incomplète en fin de lecture est conservée dans rbuf.
+// Retourne -1 en cas de trame invalide.
+int feed_client(Client *client, const char *data, size_t len) {
+    while (len > 0) {
+        if (client->rstate == READ_HEADER) {
+            struct message hdr;
+            int hdr_len;
+            if (client->rlen == 0) {
+                hdr_len = decode_header(client, data, len, &hdr);
+                if (hdr_len == 0) {
+                    // En-tête incomplet : on le met de côté
+                    if (buffer_input(client, &data, &len, len) < 0)
+                        return -1;
+                    return 0;
+                }
+                if (hdr_len > 0) {
+                    data += hdr_len;
+                    len -= hdr_len;
+                }
+            } else {
+                // HEADER_SIZE majore la taille d'un en-tête dans les deux versions
+                if (buffer_input(client, &data, &len, HEADER_SIZE) < 0)
+                    return -1;
+                hdr_len = decode_header(client, client->rbuf, client->rlen, &hdr);
+                if (hdr_len == 0)
+                    return 0;
+                if (hdr_len > 0) {
+                    // Rendre au flux les octets copiés au-delà de l'en-tête
+                    size_t extra = client->rlen - hdr_len;
+                    data -= extra;
+                    len += extra;
+                    client->rlen = 0;
+                }
+            }
+
+            if (hdr_len < 0 || !is_header_valid(&hdr)) {
+                fprintf(stderr, "Invalid frame header from fd %d\n", client->fd);
+                return -1;
+            }
+
+            if ((size_t)hdr.pld_len <= len) {
+                // Payload déjà reçu : dispatch direct depuis le tampon de lecture
+                handle_client_message(client->fd, &hdr, data, hdr.pld_len);
+                data += hdr.pld_len;
+                len -= hdr.pld_len;
+            } else {
+                // Payload incomplet : on garde l'en-tête en attendant la suite
+                if (ensure_rbuf(client) < 0)
+                    return -1;
+                memcpy(client->rbuf, &hdr, HEADER_SIZE);
+                client->rlen = HEADER_SIZE;
+                client->rstate = READ_PAYLOAD;
+            }
+        } else {
+            struct message *hdr = (struct message *)client->rbuf;
+            size_t need = HEADER_SIZE + hdr->pld_len;
+            if (buffer_input(client, &data, &len, need) < 0)
+                return -1;
+            if (client->rlen < need)
+                return 0;
+            client->rstate = READ_HEADER;
+            client->rlen = 0;
+            handle_client_message(client->fd, hdr, client->rbuf + HEADER_SIZE, hdr->pld_len);
+        }
+    }
+
+    // Aucune trame en cours : inutile de garder le tampon
+    if (client->rlen == 0 && client->rbuf) {
+        pool_free(&rbuf_pool, client->rbuf);
+        client->rbuf = NULL;
+    }
+    return 0;
+}
+
+// Lit les données d'un client jusqu'à ce que sa socket soit vide
+void handle_client_readable(Client *client) {
+    static char read_buffer[READ_CHUNK];
+
+    while (!client->read_paused && !client->closing) {
+        ssize_t received = recv(client->fd, read_buffer, sizeof(read_buffer), MSG_DONTWAIT);
+
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (received <= 0 || feed_client(client, read_buffer, received) < 0) {
+            schedule_close(client);
+            return;
+        }
+    }
+}
+
+void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-H high_watermark] [-L low_watermark] "
+            "[-M max_message_size] [-C conn_mem_cap] [-d coalesce_delay_ms] [-R relay_port] <port>\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+void parse_options(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "H:L:M:C:d:R:")) != -1) {
+        switch (opt) {
+            case 'H':
+                high_watermark = strtoul(optarg, NULL, 10);
+                break;
+            case 'L':
+                low_watermark = strtoul(optarg, NULL, 10);
+                break;
+            case 'M':
+                max_message_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'C':
+                conn_mem_cap = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                coalesce_delay = strtoul(optarg, NULL, 10);
+                break;
+            case 'R':
+                relay_port = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (conn_mem_cap == 0)
+        conn_mem_cap = OUTQ_HARD_FACTOR * high_watermark;
+    if (optind != argc - 1 || high_watermark == 0 || low_watermark > high_watermark ||
+        conn_mem_cap <= high_watermark) {
+        usage(argv[0]);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    parse_options(argc, argv);
+    const char *port = argv[optind];
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGUSR1, handle_sigusr1);
+    raise_fd_limit();
+    spare_fd = open("/dev/null", O_RDONLY);
+
+    int sfd = create_listening_socket(port);
+    printf("Server listening on port %s\n", port);
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    // La socket d'écoute est identifiée par un pointeur NULL
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sfd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    // La socket d'écoute du relais porte le marqueur RELAY_TAG seul
+    int rfd = -1;
+    if (relay_port) {
+        char relay_port_str[16];
+        snprintf(relay_port_str, sizeof(relay_port_str), "%d", relay_port);
+        rfd = create_listening_socket(relay_port_str);
+        printf("File relay listening on port %d\n", relay_port);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = (void *)RELAY_TAG;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rfd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int timeout = -1;
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+        if (n < 0) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+                break;
+            }
+            n = 0;
+        }
+        if (coalesce_delay)
+            loop_time = monotonic_ms();
+
+        // Seuls les descripteurs prêts sont parcourus
+        for (int i = 0; i < n; i++) {
+            Client *client = events[i].data.ptr;
+            if (client == NULL) {
+                accept_new_clients(sfd);
+                continue;
+            }
+            if ((uintptr_t)client & RELAY_TAG) {
+                RelayEnd *end = (RelayEnd *)((uintptr_t)client & ~RELAY_TAG);
+                if (end)
+                    handle_relay_event(end, events[i].events);
+                else
+                    accept_relay_connections(rfd);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_client(client);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                handle_client_readable(client);
+            }
+        }
+        // Une fermeture peut produire des notifications (départ d'un salon)
+        // et un envoi peut échouer et programmer une fermeture : on alterne
+        // jusqu'à ce qu'il ne reste plus de fermeture en attente
+        do {
+            close_pending_clients();
+            timeout = flush_dirty_clients();
+        } while (closing_clients);
+        if (relays || pending_ends) {
+            int relay_timeout = expire_relays();
+            if (relay_timeout >= 0 && (timeout < 0 || relay_timeout < timeout))
+                timeout = relay_timeout;
+        }
+        close_finished_relays();
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+    }
+
+    while (relays)
+        destroy_relay(relays);
+    while (pending_ends)
+        drop_pending_end(pending_ends);
+    close_finished_relays();
+    if (greeting_frame)
+        frame_release(greeting_frame);
+    pool_destroy(&outq_pool);
+    pool_destroy(&dict_pool);
+    pool_destroy(&rbuf_pool);
+    pool_destroy(&transfer_pool);
+    pool_destroy(&channel_pool);
+    pool_destroy(&client_pool);
+    close(epoll_fd);
+    close(sfd);
+    if (rfd >= 0)
+        close(rfd);
+    if (spare_fd >= 0)
+        close(spare_fd);
+    return 0;
+}